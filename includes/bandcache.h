@@ -0,0 +1,91 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef BANDCACHE_H_DEFINED
+#define BANDCACHE_H_DEFINED
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "hyperspec.h"
+#include "bandwriter.h"
+
+// Number of registered bands allowed to wait for the disk
+const size_t WRITE_DEPTH = 4;
+
+// =====================================================
+// Band containers, filters and the output writer of a
+// cube runner, kept from one cube to the next. Every
+// container and filter belongs to a role and a slot,
+// usually a band worker, and is allocated on first use.
+// Containers are only reallocated when the band size
+// changes, see reshape.
+// =====================================================
+
+class BandCache {
+public:
+  BandCache();
+
+  // Band size of the next cube. Containers and filters held for
+  // another size are dropped
+  void              reshape(
+                    // Band width
+                    unsigned xsize,
+                    // Band height
+                    unsigned ysize );
+
+  // Container of the role and slot, the contents are left as they are
+  ImageType::Pointer container(
+                    // What the container is used for
+                    const std::string &role,
+                    // Slot, usually the band worker
+                    size_t slot );
+
+  // Copy of band in the container of the role and slot, detached from
+  // any pipeline, as copyBand
+  ImageType::Pointer copy(
+                    // What the container is used for
+                    const std::string &role,
+                    // Slot, usually the band worker
+                    size_t slot,
+                    // Band to copy, of the current band size
+                    ImageType* const band );
+
+  // As filterBand, with the filters of the role and slot. The output
+  // is valid until the slot filters its next band
+  ImageType::Pointer filter(
+                    // What the filters are used for
+                    const std::string &role,
+                    // Slot, usually the band worker
+                    size_t slot,
+                    // Band to filter
+                    ImageType* const band,
+                    // Registration parameters, for the filters
+                    const reg_params &params,
+                    // Threads of each filter, 0 for the itk default
+                    int threads = 0 );
+
+  // Background writer of the registered bands, opened for every cube
+  BandWriter       &writer() { return bandWriter; }
+
+private:
+  typedef std::pair<std::string, size_t> Key;
+  struct BandFilters {
+    MedianFilterType::Pointer   median;
+    GradientFilterType::Pointer gradient;
+  };
+
+  unsigned          xsize;
+  unsigned          ysize;
+  std::mutex        lock;
+  std::map<Key, ImageType::Pointer> containers;
+  std::map<Key, BandFilters> filters;
+  BandWriter        bandWriter;
+};
+
+#endif // BANDCACHE_H_DEFINED
@@ -0,0 +1,103 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef BANDPOOL_H_DEFINED
+#define BANDPOOL_H_DEFINED
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// =====================================================
+// Band-level worker pool. Bands are registered against
+// the same read-only fixed band, so they are independent
+// and can be handed to workers in any order. Workers
+// are numbered, so that each can keep its own images.
+//
+// Tasks are dealt to per-worker queues by estimated
+// cost, most expensive first, so that long bands do not
+// end up at the tail of the run. A worker that runs out
+// of tasks steals the cheapest task left on another
+// worker's queue.
+//
+// The worker threads are started once and wait for the
+// next run, so a pool can be reused for many cubes.
+// =====================================================
+
+class BandPool {
+public:
+  explicit BandPool(
+                    // Number of workers, 1 runs the tasks on the calling thread
+                    int workers );
+
+  // Stops the worker threads
+  ~BandPool();
+
+  // Number of workers
+  int               size() const;
+
+  // Run job( worker, task ) for every task and return when all are done.
+  // Tasks are handed out in the order given. An exception thrown by a job
+  // is rethrown here once all workers have stopped. Runs on one pool do
+  // not overlap, run is called from one thread at a time.
+  void              run(
+                    // Tasks, usually band numbers
+                    const std::vector<int> &tasks,
+                    // Job, called with the worker number and the task
+                    const std::function<void(int, int)> &job );
+
+  // As above, with tasks scheduled by estimated cost
+  void              run(
+                    // Tasks, usually band numbers
+                    const std::vector<int> &tasks,
+                    // Estimated cost of each task, any unit
+                    const std::vector<double> &costs,
+                    // Job, called with the worker number and the task
+                    const std::function<void(int, int)> &job );
+
+  // Print tasks, steals and busy time of every worker in the last run
+  void              printUtilization() const;
+
+private:
+  struct WorkerStats {
+    int tasks;
+    int steals;
+    double busy;
+  };
+
+  // Body of worker thread w, waits for runs until the pool is destroyed
+  void              work( int w );
+  // Run tasks from the own queue, then steal, until all queues are empty
+  void              drain( int w );
+
+  int               workers;
+  std::vector<WorkerStats> stats;
+  double            wall;
+
+  std::vector<std::thread> threads;
+  std::mutex        mutex;
+  std::condition_variable started;
+  std::condition_variable finished;
+  // Incremented for every run, workers wait for it to change
+  long              generation;
+  // Workers still busy with the current run
+  int               active;
+  bool              quit;
+
+  // State of the current run
+  std::vector< std::deque<int> > queues;
+  std::vector<std::mutex> queueMutex;
+  const std::function<void(int, int)> *job;
+  bool              stop;
+  std::exception_ptr failure;
+};
+
+#endif // BANDPOOL_H_DEFINED
@@ -0,0 +1,68 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef BANDSTORE_H_DEFINED
+#define BANDSTORE_H_DEFINED
+
+#include <functional>
+#include <map>
+#include <vector>
+#include "hyperspec.h"
+#include "bandpool.h"
+
+// =====================================================
+// Store of read and prefiltered bands. All slots share
+// a single allocation, made once and reused for every
+// chunk of bands. Bands are read and filtered in
+// parallel, one group of bands per band worker, each
+// filter on one thread.
+// =====================================================
+
+class BandStore {
+public:
+  BandStore(
+                    // Band width
+                    unsigned xsize,
+                    // Band height
+                    unsigned ysize,
+                    // Number of bands held at a time
+                    size_t slots );
+
+  // Read and filter bands into the store, replacing what it held.
+  // At most slots bands
+  void              fill(
+                    // Bands to filter
+                    const std::vector<int> &bands,
+                    // Reads band i into the given container
+                    const std::function<ImageType::Pointer(ImageType* const, int)> &readBand,
+                    // Registration parameters, for the filters
+                    reg_params params,
+                    // Band workers, each filters a group of bands
+                    BandPool &pool );
+
+  // Filtered band i as an itk image on the store memory, valid
+  // until the next fill. NULL if band i is not in the store
+  ImageType::Pointer band( int i ) const;
+
+  // Band i as read, valid until the next fill. On the store memory,
+  // or the band as wrapped in place by the reader. NULL if band i is
+  // not in the store
+  ImageType::Pointer moving( int i ) const;
+
+  size_t            size() const { return slots; }
+
+private:
+  unsigned          xsize;
+  unsigned          ysize;
+  size_t            slots;
+  // Read bands in the first slots*xsize*ysize floats, filtered after
+  std::vector<float> data;
+  std::vector<ImageType::Pointer> read;
+  std::map<int, size_t> slot;
+};
+
+#endif // BANDSTORE_H_DEFINED
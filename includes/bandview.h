@@ -0,0 +1,57 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef BANDVIEW_H_DEFINED
+#define BANDVIEW_H_DEFINED
+
+#include <cstddef>
+#include "registration.h"
+
+// =================================================
+// Band views, moving bands between cubes and itk
+// images without going through SetPixel/GetPixel
+// =================================================
+
+// Copy a block of rows x cols elements between two strided buffers.
+// Element (r, c) is found at r*rowStride + c*colStride in both buffers.
+// Contiguous rows are copied with memcpy, everything else is copied
+// in cache sized tiles.
+void                copyStrided(
+                            // Buffer to read from
+                            const float *src,
+                            // Source stride between rows
+                            size_t srcRowStride,
+                            // Source stride between columns
+                            size_t srcColStride,
+                            // Buffer to write to
+                            float *dst,
+                            // Destination stride between rows
+                            size_t dstRowStride,
+                            // Destination stride between columns
+                            size_t dstColStride,
+                            // Number of rows
+                            size_t rows,
+                            // Number of columns
+                            size_t cols );
+
+// Wrap a contiguous band as an itk image, without copying.
+// The image does not take ownership of the data.
+ImageType::Pointer  wrapBand(
+                            // Band data, xsize*ysize floats
+                            float *data,
+                            // Image width
+                            unsigned xsize,
+                            // Image height
+                            unsigned ysize );
+
+// Deep copy of a band into a new itk image, detached from any pipeline.
+// Used to give every band worker its own copy of shared inputs.
+ImageType::Pointer  copyBand(
+                            // Band to copy
+                            ImageType* const band );
+
+#endif // BANDVIEW_H_DEFINED
@@ -0,0 +1,105 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef BANDWRITER_H_DEFINED
+#define BANDWRITER_H_DEFINED
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "readimage.h"
+#include "workqueue.h"
+
+// =====================================================
+// Background writer for registered bands. The output
+// (and diff) .img is preallocated, and every band is
+// written to its place by an I/O thread while the next
+// band is registered. The I/O thread is kept from one
+// output to the next. Errors are thrown as
+// std::runtime_error, a failed write by the next
+// writeBand or by close.
+// =====================================================
+
+class BandWriter {
+public:
+  // Writer with no output, see open
+  BandWriter(
+                    // Number of bands allowed to wait for the disk
+                    size_t depth );
+
+  // Writer opened on the given output
+  BandWriter(
+                    // Output name, without .img
+                    const char *name,
+                    // Diff output name, NULL for no diff output
+                    const char *diffName,
+                    // Header of the input image
+                    struct hyspex_header header,
+                    // Interleave of the output images
+                    interleave_t interleave,
+                    // Datatype of the output image, the diff is always float
+                    int datatype,
+                    // Number of bands allowed to wait for the disk
+                    size_t depth );
+
+  // Waits for all bands to be written, errors are dropped
+  ~BandWriter();
+
+  // Create the output (and diff) images. An output still open is
+  // closed first, dropping its errors
+  void              open(
+                    // Output name, without .img
+                    const char *name,
+                    // Diff output name, NULL for no diff output
+                    const char *diffName,
+                    // Header of the input image
+                    struct hyspex_header header,
+                    // Interleave of the output images
+                    interleave_t interleave,
+                    // Datatype of the output image, the diff is always float
+                    int datatype );
+
+  // Queue band for writing. Data is copied, so the buffers can be
+  // reused immediately. A NULL diff leaves the diff band at zero.
+  void              writeBand(
+                    // Band number
+                    int band,
+                    // Registered band, samples*lines floats
+                    const float *out,
+                    // Diff band, samples*lines floats or NULL
+                    const float *diff );
+
+  // Write all queued bands and close the files. The writer
+  // can be opened again
+  void              close();
+
+private:
+  struct BandJob {
+    int band;
+    std::vector<float> out;
+    std::vector<float> diff;
+  };
+
+  void              run();
+  std::string       flush();
+
+  struct hyperspectral_writer out;
+  struct hyperspectral_writer diff;
+  bool              hasDiff;
+  size_t            bandSize;
+  WorkQueue<BandJob> queue;
+  std::thread       thread;
+  bool              closed;
+  std::mutex        flushLock;
+  std::condition_variable flushDone;
+  bool              flushed;
+  std::string       error;
+};
+
+#endif // BANDWRITER_H_DEFINED
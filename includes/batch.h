@@ -0,0 +1,65 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef BATCH_H_DEFINED
+#define BATCH_H_DEFINED
+
+#include <string>
+#include <vector>
+#include "hyperspec.h"
+#include "bandpool.h"
+#include "bandcache.h"
+
+// =====================================================
+// Batch mode, many cubes in one process. params.conf is
+// read once, and every cube runner keeps its band worker
+// pool and band cache from one cube to the next.
+// =====================================================
+
+// One cube of a batch
+struct batch_job {
+  // Input .img or .mat
+  std::string input;
+  // Output name, replaces reg_name
+  std::string reg_name;
+  // Diff output name, replaces diff_name
+  std::string diff_name;
+};
+
+// Read a manifest. Every line holds an input cube, an output
+// name and optionally a diff output name, separated by spaces.
+// Empty lines and lines starting with # are skipped
+std::vector<struct batch_job> readManifest(
+                    // Manifest file
+                    const char *manifest );
+
+// True if path ends in extension, e.g. ".img"
+bool                hasExtension(
+                    // File name
+                    const std::string &path,
+                    // Extension, with the dot
+                    const char *extension );
+
+// Register a single cube with the given parameters, pool and
+// cache. Returns false if the input format is not supported
+bool                runBatchJob(
+                    // Cube to register
+                    const struct batch_job &job,
+                    // Registration parameters, output names are replaced
+                    reg_params params,
+                    // Band workers
+                    BandPool &pool,
+                    // Containers, filters and writer of the runner
+                    BandCache &cache );
+
+// Register all cubes in a manifest, batch_cubes at a time,
+// sharing the band workers between them
+void                hyperspec_batch(
+                    // Manifest file
+                    const char *manifest );
+
+#endif // BATCH_H_DEFINED
@@ -0,0 +1,83 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef DAEMON_H_DEFINED
+#define DAEMON_H_DEFINED
+
+#include <map>
+#include <string>
+#include <vector>
+#include "hyperspec.h"
+#include "bandpool.h"
+#include "bandcache.h"
+
+// =====================================================
+// Job daemon. A spool directory is watched for job
+// files, <name>.job, which are registered by resident
+// runners keeping their band workers between jobs.
+// A job is locked and renamed to <name>.run when
+// claimed, and renamed to <name>.done or <name>.failed
+// when finished, and its state is kept in <name>.status.
+// The lock is held until the job is finished, so a
+// claim whose lock is free was left by a daemon that is
+// gone. Several daemons can share a spool, as long as
+// its filesystem supports flock.
+// =====================================================
+
+// One job of the spool
+struct daemon_job {
+  // Job name, the job file without .job
+  std::string name;
+  // Config file, params.conf if not given
+  std::string config;
+  // Other parameters of the job, by params.conf variable name
+  std::map<std::string, std::string> overrides;
+  // Input cube, or all frames of a raw job
+  std::vector<std::string> cubes;
+  // Output names, from the config if not given
+  std::string reg_name;
+  std::string diff_name;
+  // Descriptor of the claimed job file, locked while the job is
+  // claimed, -1 if not claimed
+  int claim = -1;
+};
+
+// Read a job file. Lines are key = value, where cube (repeated for
+// raw frames), config, reg_name and diff_name describe the job and
+// other params.conf keys override the config. The thread keys,
+// workers, itk_threads, thread_budget and batch_cubes, belong to the
+// daemon. Returns false with a message if the job is not usable or
+// has a key it may not set
+bool                readJob(
+                    // Job file
+                    const std::string &path,
+                    // Job to fill in
+                    struct daemon_job &job,
+                    // Reason for rejecting the job
+                    std::string &message );
+
+// Run a single job on the given pool, with the thread split of the
+// daemon. Returns false with a message if the job failed
+bool                runJob(
+                    // Job to run
+                    const struct daemon_job &job,
+                    // Band workers
+                    BandPool &pool,
+                    // Containers, filters and writer of the runner
+                    BandCache &cache,
+                    // Daemon parameters, already applied by setThreadBudget
+                    const struct reg_params &daemon,
+                    // Reason for the failure
+                    std::string &message );
+
+// Watch a spool directory and run its jobs, batch_cubes at a time,
+// until a file named stop appears in it or the daemon is signalled
+void                hyperspec_daemon(
+                    // Spool directory
+                    const char *spool );
+
+#endif // DAEMON_H_DEFINED
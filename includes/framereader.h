@@ -0,0 +1,62 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef FRAMEREADER_H_DEFINED
+#define FRAMEREADER_H_DEFINED
+
+#include <string>
+#include <thread>
+#include "multispec.h"
+#include "workqueue.h"
+
+// =====================================================
+// Read-ahead of raw frames. Frames are read and
+// converted to float on a background thread, up to
+// depth frames ahead of the registration.
+// =====================================================
+
+class FrameReader {
+public:
+  FrameReader(
+                    // Frame geometry
+                    struct hyspex_header header,
+                    // Frame files
+                    char *files[],
+                    // Number of frame files
+                    int count,
+                    // Number of frames read ahead
+                    size_t depth );
+
+  // Stops reading and waits for the reader thread
+  ~FrameReader();
+
+  // Next frame, in the order of the files. Returns false when all
+  // frames are read, throws std::runtime_error if a frame could not
+  // be read.
+  bool              nextFrame(
+                    // Index of the frame in files
+                    int &i,
+                    // Frame, converted to float
+                    ImageType::Pointer &frame );
+
+private:
+  struct Frame {
+    int i;
+    ImageType::Pointer image;
+  };
+
+  void              run();
+
+  struct hyspex_header header;
+  char            **files;
+  int               count;
+  WorkQueue<Frame>  queue;
+  std::thread       thread;
+  std::string       error;
+};
+
+#endif // FRAMEREADER_H_DEFINED
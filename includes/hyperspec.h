@@ -5,11 +5,16 @@
 // http://opensource.org/licenses/MIT
 // =========================================================================
 
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 #include "string.h"
 #include "matio.h"
+#include "readimage.h"
 
 #ifndef HYPERSPEC_H_DEFINED
 #define HYPERSPEC_H_DEFINED
@@ -51,10 +56,76 @@ struct reg_params {
   double translationScale;
   // Intial Translation transform
   int translation;
+  // Largest side of the window of phase correlation
+  int phase_window;
   // Choose between mutual information and mean squares
   int metric;
   // Option for suppressing iteration outputs
   int output;
+  // Memory-map input image instead of reading it
+  int mmap;
+  // Interleave of output .img, BIL or BSQ
+  interleave_t interleave;
+  // Register band by band straight to disk
+  int streaming;
+  // Datatype of output .img, 0 for the input datatype
+  int datatype;
+  // Width of raw frames
+  int raw_width;
+  // Height of raw frames
+  int raw_height;
+  // Datatype of raw frames
+  int raw_datatype;
+  // Header bytes skipped at the start of raw frames
+  int raw_skip;
+  // Number of raw frames read ahead
+  int prefetch;
+  // Number of bands registered concurrently, 0 to split the budget
+  int workers;
+  // Schedule bands by timings of the previous run
+  int cost_history;
+  // Total number of threads, 0 for all cores
+  int thread_budget;
+  // Threads used by itk for each band, 0 to split the budget
+  int itk_threads;
+  // Shard of the band range registered by this process
+  int shard_index;
+  // Number of shards the band range is split into
+  int shard_count;
+  // Merge the partial outputs of all shards instead of registering
+  int merge;
+  // Run .img bands through the stage pipeline instead of the band pool
+  int pipeline;
+  // Number of bands waiting between two pipeline stages
+  int pipeline_depth;
+  // Number of cubes of a batch registered at the same time
+  int batch_cubes;
+  // Filter all bands up front, 1, or each band before its registration, 0
+  int prefilter;
+  // Number of bands filtered up front at a time, 0 for all
+  int prefilter_chunk;
+  // Register outward from the center band, each band starting from
+  // its spectral neighbour's transform
+  int spectral_walk;
+  // Register every band against its spectral neighbour and compose
+  // the transforms back to the center band
+  int chained;
+  // Metric sampling of the v4 registrations, 0 none, 1 regular, 2 random
+  int sampling;
+  // Fraction of the fixed image pixels sampled
+  double sampling_percentage;
+  // Seed of the sampling, 0 for a new seed every registration
+  int sampling_seed;
+  // Register every anchor_step-th band and fit the others, 0 for all
+  int anchor_step;
+  // Degree of the polynomials fitted against wavelength
+  int anchor_degree;
+  // Drop in correlation that sends a fitted band to full registration
+  double anchor_tolerance;
+  // Lines per demons strip, 0 registers the band in one piece
+  int demons_tile;
+  // Lines shared by neighbouring demons strips
+  int demons_overlap;
 };
 
 // ======
@@ -67,7 +138,9 @@ enum conf_err_t {
   // File not found
   CONF_FILE_NOT_FOUND,
   // Read error
-  CONF_FILE_READING_ERROR
+  CONF_FILE_READING_ERROR,
+  // Value out of range, the default is used
+  CONF_INVALID_VALUE
 };
 
 
@@ -75,9 +148,40 @@ enum conf_err_t {
 // Functions
 // =========
 
-// Read config (params.conf)
+// Read config (params.conf) and apply its thread budget. Exits on
+// an invalid value
 conf_err_t params_read( struct reg_params *params);
 
+// Read a named config. Values in overrides win over both the config
+// and params_set. The thread budget is left to the caller, see
+// setThreadBudget. Returns CONF_INVALID_VALUE after printing the
+// reason if a value is out of range
+conf_err_t params_read(
+                            struct reg_params *params,
+                            // Config file
+                            const std::string &confName,
+                            // Extra parameters, by variable name
+                            const std::map<std::string, std::string> &overrides );
+
+// True if property is a variable read from params.conf
+bool                params_known(
+                            // Variable name
+                            const std::string &property );
+
+// Set a parameter, overriding params.conf. Returns false, and sets
+// nothing, if property is not a known variable
+bool                params_set(
+                            // Variable name
+                            std::string property,
+                            // Value, as it would be written in params.conf
+                            std::string value );
+
+// Split the thread budget into band workers and itk threads,
+// and apply the itk share globally
+void                setThreadBudget(
+                            // Registration parameters, updated with the split
+                            struct reg_params *params );
+
 // Retrieve variable from config
 std::string         getParam(
                             // Variable name
@@ -85,17 +189,221 @@ std::string         getParam(
                             // Variable value
                             std::string property );
 
+class BandPool;
+class BandCache;
+
 // Read a hyperspectral .img file and
 // output a registrated .img file
 void                hyperspec_img(
                             const char *filename );
 
+// As above, with parameters already read and
+// the band worker pool and cache of a runner
+void                hyperspec_img(
+                            // Input .img
+                            const char *filename,
+                            // Registration parameters
+                            reg_params params,
+                            // Band workers
+                            BandPool &pool,
+                            // Containers, filters and writer of the workers
+                            BandCache &cache );
+
+// Register a hyperspectral .img band by band, writing
+// each band to disk as soon as it is registered
+void                hyperspec_stream(
+                            // Input .img
+                            const char *filename,
+                            // Header of input .img
+                            struct hyspex_header header,
+                            // Registration parameters
+                            reg_params params,
+                            // Band workers
+                            BandPool &pool,
+                            // Containers, filters and writer of the workers
+                            BandCache &cache );
+
 // Read a hyperspectral .mat file and
 // output a registrated .mat file
 void                hyperspec_mat(
                             const char *filename );
 
+// As above, with parameters already read and
+// the band worker pool and cache of a runner
+void                hyperspec_mat(
+                            // Input .mat
+                            const char *filename,
+                            // Registration parameters
+                            reg_params params,
+                            // Band workers
+                            BandPool &pool,
+                            // Containers and filters of the workers
+                            BandCache &cache );
+
 #include "registration.h"
+// Name of the diff output, NULL if
+// diff output is disabled or unavailable
+const char*         diffOutputName(
+                            // Registration parameters
+                            const reg_params &params );
+
+// Datatype of the output .img
+int                 outputDatatype(
+                            // Registration parameters
+                            const reg_params &params,
+                            // Header of the input .img
+                            struct hyspex_header header );
+
+// Print progress of a registered band, safe
+// to call from band workers
+void                bandDone(
+                            // Band number
+                            int i,
+                            // Number of bands
+                            int bands );
+
+typedef std::chrono::steady_clock Clock;
+
+// Seconds elapsed since start
+double              secondsSince(
+                            // Start time
+                            Clock::time_point start );
+
+// Estimated cost of registering each band
+std::vector<double> bandCosts(
+                            // Registration parameters
+                            const reg_params &params,
+                            // Band numbers
+                            const std::vector<int> &bands,
+                            // Fixed band
+                            int center );
+
+// Per-band seconds from the previous run, read
+// from <reg_name>.cost
+std::map<int, double>
+                    readCostHistory(
+                            // Registration parameters
+                            const reg_params &params );
+
+// Write per-band seconds to <reg_name>.cost
+void                writeCostHistory(
+                            // Registration parameters
+                            const reg_params &params,
+                            // Seconds per band, 0 for bands not registered
+                            const std::vector<double> &seconds );
+
+// Filter a band before registration, with
+// median and/or gradient filter as set in params
+ImageType::Pointer  filterBand(
+                            // Band to filter
+                            ImageType* const band,
+                            // Registration parameters
+                            reg_params params,
+                            // Itk threads, 0 for the itk default
+                            int threads = 0 );
+
+// Register a band with the method set in params
+void                registerBand(
+                            // Fixed image
+                            ImageType* const fixed,
+                            // Filtered fixed image
+                            ImageType* const ffixed,
+                            // Moving image
+                            ImageType* const moving,
+                            // Filtered moving image
+                            ImageType* const fmoving,
+                            // Registration parameters
+                            reg_params params,
+                            // Registered moving image
+                            ImageType::Pointer &output,
+                            // Difference between moving image and output,
+                            // not set for demons
+                            ImageType::Pointer &outdiff );
+
+class BandWriter;
+// Register bands against the fixed band, on the band
+// pool or the stage pipeline, and hand them to the writer
+void                registerBands(
+                            // Bands to register
+                            const std::vector<int> &bands,
+                            // Fixed image
+                            ImageType* const fixed,
+                            // Filtered fixed image
+                            ImageType* const ffixed,
+                            // Reads band i, into the container if it has to be copied
+                            const std::function<ImageType::Pointer(ImageType* const, int)> &readBand,
+                            // Output containers
+                            BandWriter &writer,
+                            // Band number of the first band in the output
+                            int firstBand,
+                            // Header of the input image
+                            struct hyspex_header header,
+                            // Registration parameters
+                            reg_params params,
+                            // Band workers
+                            BandPool &pool,
+                            // Containers and filters of the workers
+                            BandCache &cache );
+
+// Transform found by registering a band, only the
+// one matching regmethod is set
+struct band_transform {
+  TransformRigidType::Pointer       rigid;
+  TransformSimilarityType::Pointer  similarity;
+  TransformAffineType::Pointer      affine;
+  TransformBSplineType::Pointer     bspline;
+  // Translation, and for B-spline its initial translation if any
+  CompositeTransformType::Pointer   translation;
+  // Demons, warps the moving image with the displacement field
+  WarperType::Pointer               warper;
+  // Optimizer iterations used, rigid, similarity and affine only
+  unsigned                          iterations;
+};
+
+// Register a band, without resampling
+struct band_transform solveBand(
+                            // Fixed image
+                            ImageType* const fixed,
+                            // Filtered fixed image
+                            ImageType* const ffixed,
+                            // Moving image
+                            ImageType* const moving,
+                            // Filtered moving image
+                            ImageType* const fmoving,
+                            // Registration parameters
+                            reg_params params,
+                            // Solved transform to start from, rigid,
+                            // similarity and affine only
+                            const struct band_transform *initial = NULL );
+
+// Resample a band with the transform from solveBand
+void                resampleBand(
+                            // Fixed image, gives the output geometry
+                            ImageType* const fixed,
+                            // Moving image
+                            ImageType* const moving,
+                            // Transform of the band
+                            const struct band_transform &transform,
+                            // Registration parameters
+                            reg_params params,
+                            // Registered moving image
+                            ImageType::Pointer &output,
+                            // Itk threads, 0 for the itk default
+                            int threads = 0 );
+
+// Difference between a band before and after registration
+void                diffBand(
+                            // Moving image
+                            ImageType* const moving,
+                            // Registered moving image
+                            ImageType* const output,
+                            // Registration parameters
+                            reg_params params,
+                            // Difference image, not set for demons
+                            ImageType::Pointer &outdiff,
+                            // Itk threads, 0 for the itk default
+                            int threads = 0 );
+
 // Create an image pointer for .img
 ImageType::Pointer  imageContainer(
                             // Get size of image from .hdr
@@ -112,6 +420,17 @@ ImageType::Pointer  readITK(
                             // Image storage format
                             struct hyspex_header header );
 
+// Read an image into an image pointer from a memory-mapped .img.
+// Float BSQ bands are returned as a new image wrapping the mapping,
+// and itkimg is then left untouched
+ImageType::Pointer  readITK(
+                            // Pointer to write to, unless the band is wrapped
+                            ImageType* const itkimg,
+                            // Mapped image to read from
+                            struct hyperspectral_mmap *image,
+                            // Image band
+                            int i );
+
 // Write an image from an image pointer to a float*
 float*              writeITK(
                             // Pointer to read from
@@ -156,15 +475,4 @@ float*              writeMat(
                             // Image height
                             unsigned ySize );
 
-// Write float* to .mat
-void                outMat(
-                            // Output float
-                            float *hData,
-                            // Output name
-                            std::string outname,
-                            // Wavelengths
-                            matvar_t *wavelengthsd,
-                            // Dimensions
-                            matvar_t *HSId );
-
 #endif // HYPERSPEC_READ_H_DEFINED
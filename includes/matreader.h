@@ -0,0 +1,77 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef MATREADER_H_DEFINED
+#define MATREADER_H_DEFINED
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "matio.h"
+#include "workqueue.h"
+
+// =====================================================
+// Background reader for .mat cubes. Bands are read one
+// at a time as hyperslabs of the variable, so the whole
+// cube is never held in memory, and the next band is
+// read while the current one is registered.
+// zlib compressed MAT5 cubes get no memory benefit: the
+// whole cube is inflated into memory before the first
+// band is handed out, and only the copy per band overlaps
+// with registration.
+// =====================================================
+
+class MatBandReader {
+public:
+  MatBandReader(
+                    // Open .mat file, owned by the reader thread until
+                    // the reader is destroyed
+                    mat_t *matfp,
+                    // Variable info from Mat_VarReadInfo, see supported
+                    matvar_t *info,
+                    // Order in which bands are read
+                    const std::vector<int> &order,
+                    // Number of bands read ahead
+                    size_t depth );
+
+  // Stops reading and waits for the reader thread
+  ~MatBandReader();
+
+  // True if the variable is a real 3D cube of a class the reader
+  // converts to float: single, double or 8, 16 or 32 bit integers
+  static bool       supported(
+                    // Variable info from Mat_VarReadInfo
+                    const matvar_t *info );
+
+  // Next band in the given order. Returns false when all bands are read,
+  // throws std::runtime_error if the reader could not read a band.
+  // Band data is column-major, dims[0]*dims[1] floats.
+  bool              nextBand(
+                    // Band number
+                    int &band,
+                    // Band data
+                    std::vector<float> &data );
+
+private:
+  struct MatBand {
+    int band;
+    std::vector<float> data;
+  };
+
+  void              run();
+
+  mat_t            *matfp;
+  matvar_t         *info;
+  std::vector<int>  order;
+  size_t            bandSize;
+  size_t            elementBytes;
+  WorkQueue<MatBand> queue;
+  std::thread       thread;
+  std::string       error;
+};
+
+#endif // MATREADER_H_DEFINED
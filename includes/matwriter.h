@@ -0,0 +1,56 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef MATWRITER_H_DEFINED
+#define MATWRITER_H_DEFINED
+
+#include <string>
+#include <sys/types.h>
+#include "matio.h"
+
+// =====================================================
+// Band writer for .mat outputs. The wavelengths are
+// written by matio, and the cube is appended as an
+// uncompressed single HSI variable of preallocated
+// size, so that every band is written to its place as
+// soon as it is registered and the cube is never held
+// in memory. Bands can be written from any thread.
+// Errors are thrown as std::runtime_error.
+// =====================================================
+
+class MatBandWriter {
+public:
+  MatBandWriter(
+                    // Output name, without .mat
+                    const std::string &name,
+                    // Wavelengths, written as read
+                    matvar_t *wavelengths,
+                    // Cube dimensions, rows, columns and bands
+                    const size_t *dims );
+
+  // Closes the file
+  ~MatBandWriter();
+
+  // Write a band, column-major, dims[0]*dims[1] floats. Bands
+  // never written are left at zero
+  void              writeBand(
+                    // Band number
+                    int band,
+                    // Band data
+                    const float *data );
+
+  // Close the file
+  void              close();
+
+private:
+  std::string       path;
+  int               fd;
+  off_t             dataStart;
+  size_t            bandBytes;
+};
+
+#endif // MATWRITER_H_DEFINED
@@ -16,12 +16,15 @@ void                    multispec_raw(
                     char *argv[] );
 
 #include "registration.h"
-// Create raw itk container
-UintImageType::Pointer  rawContainer(
-                    // Image width
-                    int xsize,
-                    // Image height
-                    int ysize );
+#include "hyperspec.h"
+// Read .raw files with given parameters
+void                    multispec_raw(
+                    // Number of inputs
+                    int argc,
+                    // Inputs
+                    char *argv[],
+                    // Registration parameters
+                    struct reg_params params );
 
 // Create float itk container
 ImageType::Pointer      imgContainer(
@@ -30,30 +33,33 @@ ImageType::Pointer      imgContainer(
                     // Image height
                     int ysize );
 
+// Geometry of the raw frames
+struct hyspex_header    rawHeader(
+                    // Registration parameters
+                    struct reg_params params,
+                    // First frame, a .hdr next to it overrides params
+                    char *argv );
+
 // Read raw image to itk container
-UintImageType::Pointer  readRaw(
+ImageType::Pointer      readRaw(
                     // Pointer to write to
-                    UintImageType* const itkimg,
-                    // Image number
-                    int i,
-                    // Image width
-                    int xsize,
-                    // Image height
-                    int ysize,
+                    ImageType* const itkimg,
+                    // Frame geometry
+                    struct hyspex_header header,
                     // File to read from
                     char *argv );
 
 // Write images from itk container to raw format
 void                    writeRaw(
                     // Pointer to read from
-                    UintImageType* const itkimg,
+                    ImageType* const itkimg,
                     // Image number
                     int i,
-                    // Image width
-                    int xsize,
-                    // Image height
-                    int ysize,
+                    // Frame geometry
+                    struct hyspex_header header,
                     // Output name
-                    std::string name );
+                    std::string name,
+                    // Where to log the output name
+                    std::ostream &log = std::cout );
 
 #endif // MULTISPEC_H_DEFINED
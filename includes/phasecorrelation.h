@@ -0,0 +1,56 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef PHASECORRELATION_H_DEFINED
+#define PHASECORRELATION_H_DEFINED
+
+#include <complex>
+#include <cstddef>
+
+// =====================================================
+// Phase correlation. The shift between two bands is
+// found in one pass from the peak of the inverse FFT of
+// their normalized cross power spectrum, refined to
+// sub-pixel precision from the ratio of the peak to its
+// larger neighbour, as the peak is a sampled sinc.
+// =====================================================
+
+// Default largest side of the window correlated, phase_window in
+// params.conf
+const int PHASE_WINDOW = 2048;
+
+// In-place radix-2 FFT of n complex values spaced stride apart.
+// n must be a power of two. The inverse is not scaled by 1/n
+void                fft(
+                    // Values to transform
+                    std::complex<float> *data,
+                    // Number of values
+                    size_t n,
+                    // Distance between values
+                    size_t stride,
+                    // Inverse transform
+                    bool inverse );
+
+// Shift of moving relative to fixed, such that moving(x + shift) matches
+// fixed(x), in pixels. Returns the height of the correlation peak, near 1
+// for a clean match and near 0 when the bands do not correlate
+double              phaseCorrelation(
+                    // Fixed band, width x height floats row by row
+                    const float *fixed,
+                    // Moving band, same size
+                    const float *moving,
+                    // Band width
+                    int width,
+                    // Band height
+                    int height,
+                    // Shift along width and height
+                    double shift[2],
+                    // Largest side of the window correlated, larger
+                    // bands use their center
+                    int window = PHASE_WINDOW );
+
+#endif // PHASECORRELATION_H_DEFINED
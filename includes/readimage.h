@@ -17,9 +17,9 @@
 #include <iostream>
 
 /**
- * Interleave, BIL or BIP. BSQ not supported.
+ * Interleave, BIL, BIP or BSQ.
  **/
-enum interleave_t{BIL_INTERLEAVE, BIP_INTERLEAVE};
+enum interleave_t{BIL_INTERLEAVE, BIP_INTERLEAVE, BSQ_INTERLEAVE};
 
 /**
  * Container for hyperspectral header file.
@@ -39,6 +39,8 @@ struct hyspex_header {
 	std::vector<float> wlens;
 	///Datatype of values in hyperspectral file
 	int datatype;
+	///Byte order of values in hyperspectral file, 0 for little endian, 1 for big endian
+	int byte_order;
 };
 
 /**
@@ -77,6 +79,45 @@ enum hyperspectral_err_t {
 	HYPERSPECTRAL_FILE_READING_ERROR
 };
 
+/**
+ * Memory-mapped hyperspectral image. The .img file is mapped once, lines and bands are accessed directly in the mapping.
+ **/
+struct hyperspectral_mmap {
+	///Header of the mapped image
+	struct hyspex_header header;
+	///Subset of the image exposed through line and band views
+	struct image_subset subset;
+	///Start of the mapping
+	void *map;
+	///Length of the mapping in bytes
+	size_t map_length;
+	///First byte of the image data, header offset already skipped
+	const char *data;
+	///Number of bytes per element
+	size_t element_bytes;
+};
+
+/**
+ * View of a single band in the mapping, no data is copied. Element (line, sample) of the band is found at
+ * data + line*line_stride + sample*sample_stride, strides given in bytes.
+ **/
+struct hyperspectral_band_view {
+	///First element of the band within the subset
+	const char *data;
+	///Bytes between consecutive lines
+	size_t line_stride;
+	///Bytes between consecutive samples
+	size_t sample_stride;
+	///Number of samples in the view
+	int samples;
+	///Number of lines in the view
+	int lines;
+	///Datatype of the elements, as in the header
+	int datatype;
+	///Whether the elements are stored in the opposite byte order of the host
+	bool byte_swap;
+};
+
 /**
  * Read header information from file.
  *
@@ -107,6 +148,73 @@ hyperspectral_err_t hyperspectral_read_image(const char *filename, struct hyspex
  **/
 hyperspectral_err_t hyperspectral_read_image(const char *filename, struct hyspex_header *header, float *data);
 
+/**
+ * Memory-map hyperspectral image. Nothing is read until lines or bands are accessed through the views.
+ *
+ * \param filename Filename
+ * \param header Header, already read from file using hyperspectral_read_header
+ * \param subset Image subset exposed through the views
+ * \param image Output mapping, release with hyperspectral_unmap_image
+ * \return HYPERSPECTRAL_NO_ERR on success
+ **/
+hyperspectral_err_t hyperspectral_mmap_image(const char *filename, struct hyspex_header *header, struct image_subset subset, struct hyperspectral_mmap *image);
+
+/**
+ * Overloaded version of hyperspectral_mmap_image mapping the full image.
+ *
+ * \param filename Filename
+ * \param header Header information
+ * \param image Output mapping
+ * \return HYPERSPECTRAL_NO_ERR on success
+ **/
+hyperspectral_err_t hyperspectral_mmap_image(const char *filename, struct hyspex_header *header, struct hyperspectral_mmap *image);
+
+/**
+ * Release memory-mapped image.
+ *
+ * \param image Mapping from hyperspectral_mmap_image
+ **/
+void hyperspectral_unmap_image(struct hyperspectral_mmap *image);
+
+/**
+ * Raw line of a memory-mapped image, in file interleave and datatype. All samples and bands of the line are included,
+ * except for BSQ images, where only the line of the first band is contiguous. Use band views or slices for BSQ.
+ *
+ * \param image Mapping
+ * \param line Line number, relative to the start line of the subset
+ * \return Pointer into the mapping
+ **/
+const char *hyperspectral_mmap_line(const struct hyperspectral_mmap *image, int line);
+
+/**
+ * Strided view of a band in a memory-mapped image, restricted to the subset.
+ *
+ * \param image Mapping
+ * \param band Band number, relative to the start band of the subset
+ * \return Band view
+ **/
+struct hyperspectral_band_view hyperspectral_mmap_band(const struct hyperspectral_mmap *image, int band);
+
+/**
+ * Convert band view to float. This is where uint16 and int16 files are converted, float files are copied line by line.
+ * Files in the opposite byte order of the host are swapped in the same pass.
+ *
+ * \param view Band view
+ * \param data Output data, preallocated to view.samples*view.lines. Pixels are written to data[line_stride*line_number + sample_number].
+ * \param line_stride Number of floats between consecutive lines in data
+ **/
+void hyperspectral_band_to_float(struct hyperspectral_band_view view, float *data, size_t line_stride);
+
+/**
+ * Direct slice of a band which is one contiguous run of floats in the mapping, as for float BSQ images read without
+ * a sample subset and stored in the byte order of the host. The slice can be used in place, pixels are found at slice[samples*line_number + sample_number].
+ * The mapping is read-only, writing through the slice faults.
+ *
+ * \param view Band view
+ * \return Pointer into the mapping, or NULL if the band is not a contiguous float array
+ **/
+float *hyperspectral_band_slice(struct hyperspectral_band_view view);
+
 /**
  * Write header information to file.
  *
@@ -115,8 +223,10 @@ hyperspectral_err_t hyperspectral_read_image(const char *filename, struct hyspex
  * \param samples Number of samples (across-track)
  * \param lines Number of lines (along-track)
  * \param wlens Wavelength array
+ * \param interleave Interleave of the image file, BIL or BSQ
+ * \param datatype Datatype of the image file, 4 (float), 12 (uint16), 2 (int16) or 1 (uint8)
  **/
-void hyperspectral_write_header(const char *filename, int bands, int samples, int lines, std::vector<float> wlens);
+void hyperspectral_write_header(const char *filename, int bands, int samples, int lines, std::vector<float> wlens, interleave_t interleave, int datatype);
 
 /**
  * Write hyperspectral image to file.
@@ -125,9 +235,88 @@ void hyperspectral_write_header(const char *filename, int bands, int samples, in
  * \param bands Bands
  * \param samples Samples
  * \param lines Lines
- * \param data Image data
+ * \param data Image data, BIL ordered as in hyperspectral_read_image
+ * \param interleave Interleave of the image file, BIL or BSQ. BSQ files are written band by band with sequential I/O.
+ * \param datatype Datatype of the image file, see hyperspectral_float_to_datatype
+ **/
+void hyperspectral_write_image(const char *filename, int bands, int samples, int lines, float *data, interleave_t interleave, int datatype);
+
+/**
+ * Byte order of the host, as used in the header.
+ *
+ * \return 0 for little endian, 1 for big endian
+ **/
+int hyperspectral_host_byte_order();
+
+/**
+ * Number of bytes per element of a datatype.
+ *
+ * \param datatype Datatype, as in the header
+ * \return Element size, or 0 for unsupported datatypes
+ **/
+size_t hyperspectral_datatype_bytes(int datatype);
+
+/**
+ * Convert float data to the datatype of an image file. Integer datatypes are rounded to nearest and clamped to their
+ * range, in a single vectorizable pass.
+ *
+ * \param src Float data
+ * \param numElements Number of elements
+ * \param datatype Datatype, 4 (float), 12 (uint16), 2 (int16) or 1 (uint8)
+ * \param dst Output data, preallocated to numElements*hyperspectral_datatype_bytes(datatype) bytes
+ **/
+void hyperspectral_float_to_datatype(const float *src, size_t numElements, int datatype, char *dst);
+
+/**
+ * Output hyperspectral image which is written band by band, see hyperspectral_create_image.
+ **/
+struct hyperspectral_writer {
+	///File descriptor of the .img file
+	int fd;
+	///Number of bands
+	int bands;
+	///Number of samples (across-track)
+	int samples;
+	///Number of lines (along-track)
+	int lines;
+	///Interleave of the image file
+	interleave_t interleave;
+	///Datatype of the image file
+	int datatype;
+};
+
+/**
+ * Create hyperspectral image file for writing band by band. The file is preallocated to its full size, bands which
+ * are never written read as zero.
+ *
+ * \param filename Filename, without .img
+ * \param bands Bands
+ * \param samples Samples
+ * \param lines Lines
+ * \param interleave Interleave of the image file, BIL or BSQ
+ * \param datatype Datatype of the image file, bands are converted when written
+ * \param writer Output writer, release with hyperspectral_close_image
+ * \return HYPERSPECTRAL_NO_ERR on success
+ **/
+hyperspectral_err_t hyperspectral_create_image(const char *filename, int bands, int samples, int lines, interleave_t interleave, int datatype, struct hyperspectral_writer *writer);
+
+/**
+ * Write a single band to its position in the image file, using positioned writes. BSQ bands are written with one
+ * sequential write, BIL bands with one write per line. Integer files are converted on the way.
+ *
+ * \param writer Writer from hyperspectral_create_image
+ * \param band Band number
+ * \param data Band data, pixels at data[samples*line_number + sample_number]
+ * \return HYPERSPECTRAL_NO_ERR on success
+ **/
+hyperspectral_err_t hyperspectral_write_band(struct hyperspectral_writer *writer, int band, const float *data);
+
+/**
+ * Close image file opened with hyperspectral_create_image.
+ *
+ * \param writer Writer
  **/
-void hyperspectral_write_image(const char *filename, int bands, int samples, int lines, float *data);
+void hyperspectral_close_image(struct hyperspectral_writer *writer);
 
 
 #endif
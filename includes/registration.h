@@ -281,12 +281,19 @@ DifferenceFilterType::Pointer diffFilter(
                             ResampleFilterType::Pointer resample );
 
 // Image filtering
+// Limit a filter to the given number of threads, 0 leaves the itk default
+void                          setFilterThreads(
+                              itk::ProcessObject* const filter,
+                              int threads );
+// threads > 0 limits the filter to that many threads
 ImageType::Pointer            gradientFilter(
                               ImageType* const fixed,
-                              int sigma );
+                              int sigma,
+                              int threads = 0 );
 ImageType::Pointer            medianFilter(
                               ImageType* const fixed,
-                              int radius );
+                              int radius,
+                              int threads = 0 );
 
 // Image I/O
 CastFilterFloatType::Pointer  castFloatImage(
@@ -303,28 +310,89 @@ void finalAffineParameters( TransformAffineType::Pointer transform,
                       OptimizerType::Pointer optimizer,
                       RegistrationAffineType::Pointer registration );
 
-// Image registrations
+// Image registrations. Rigid, similarity and affine start from initial
+// if given, and report the optimizer iterations used in iterations.
+// With params.translation the band is first shifted by an initial
+// translation, which the returned transforms include. A warm start
+// already holds the shift of its band and is not shifted again
 #include "hyperspec.h"
+
+// Metric sampling of a v4 registration as set in params, the same for
+// every registration method. A seed above 0 makes random sampling repeatable
+template <typename TRegistration>
+void setMetricSampling( TRegistration* const registration, const reg_params &params ){
+#if ITK_VERSION_MAJOR > 5 || ( ITK_VERSION_MAJOR == 5 && ITK_VERSION_MINOR >= 1 )
+  typedef itk::ImageRegistrationMethodv4Enums::MetricSamplingStrategy StrategyType;
+  const StrategyType none     = StrategyType::NONE;
+  const StrategyType regular  = StrategyType::REGULAR;
+  const StrategyType random   = StrategyType::RANDOM;
+#else
+  typedef typename TRegistration::MetricSamplingStrategyType StrategyType;
+  const StrategyType none     = TRegistration::NONE;
+  const StrategyType regular  = TRegistration::REGULAR;
+  const StrategyType random   = TRegistration::RANDOM;
+#endif
+  if ( params.sampling == 0 ){
+    registration->SetMetricSamplingStrategy( none );
+    return;
+  }
+  registration->SetMetricSamplingStrategy( params.sampling == 1 ? regular : random );
+  registration->SetMetricSamplingPercentage( params.sampling_percentage );
+  if ( params.sampling_seed > 0 ){
+    registration->MetricSamplingReinitializeSeed( params.sampling_seed );
+  } else {
+    registration->MetricSamplingReinitializeSeed();
+  }
+}
+
+// Add an initial translation to a solved rigid, similarity or affine
+// transform. The registration applies the moving initial transform only
+// while optimizing, after the solved transform, so the solved transform
+// alone resamples without the shift
+template <typename TTransform>
+void composeTranslation( TTransform* const transform, CompositeTransformType* const initial ){
+  typename TTransform::InputPointType origin;
+  origin.Fill( 0.0 );
+  transform->SetTranslation( transform->GetTranslation()
+                             + ( initial->TransformPoint( origin ) - origin ) );
+}
 TransformRigidType::Pointer registration1(
                             ImageType* const fixed,
                             ImageType* const moving,
-                            reg_params params );
+                            reg_params params,
+                            TransformRigidType* const initial = NULL,
+                            unsigned *iterations = NULL );
 TransformSimilarityType::Pointer registration2(
                             ImageType* const fixed,
                             ImageType* const moving,
-                            reg_params params );
+                            reg_params params,
+                            TransformSimilarityType* const initial = NULL,
+                            unsigned *iterations = NULL );
 TransformAffineType::Pointer registration3(
                             ImageType* const fixed,
                             ImageType* const moving,
-                            reg_params params );
+                            reg_params params,
+                            TransformAffineType* const initial = NULL,
+                            unsigned *iterations = NULL );
 TransformBSplineType::Pointer registration4(
                             ImageType* const fixed,
                             ImageType* const moving,
-                            reg_params params );
+                            reg_params params,
+                            CompositeTransformType::Pointer *initial = NULL );
 CompositeTransformType::Pointer translation(
                             ImageType* const fixed,
                             ImageType* const moving,
                             reg_params params );
+// Translation by phase correlation, in the same form as translation
+CompositeTransformType::Pointer phaseTranslation(
+                            ImageType* const fixed,
+                            ImageType* const moving,
+                            reg_params params );
+// Initial translation as chosen by params.translation
+CompositeTransformType::Pointer initialTranslation(
+                            ImageType* const fixed,
+                            ImageType* const moving,
+                            reg_params params );
 WarperType::Pointer registration5(
                             ImageType* const fixed,
                             ImageType* const moving,
@@ -0,0 +1,59 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef SHARD_H_DEFINED
+#define SHARD_H_DEFINED
+
+#include <string>
+#include "hyperspec.h"
+
+// =====================================================
+// Band-range sharding of one cube across processes.
+// Shard k of n registers a contiguous band range against
+// the same fixed band and writes a partial cube,
+// <name>_shard<k>.img/.hdr, with a small index
+// <name>_shard<k>.idx. Merge mode concatenates the
+// partial cubes into <name>.img/.hdr.
+// =====================================================
+
+// Band range of this shard, all samples and lines
+struct image_subset shardRange(
+                    // Registration parameters
+                    const reg_params &params,
+                    // Header of the input image
+                    struct hyspex_header header );
+
+// Header of the partial cube of this shard
+struct hyspex_header shardHeader(
+                    // Header of the input image
+                    struct hyspex_header header,
+                    // Band range of the shard
+                    struct image_subset range );
+
+// Output name of this shard, name itself when not sharding
+std::string         shardName(
+                    // Output name
+                    const std::string &name,
+                    // Registration parameters
+                    const reg_params &params );
+
+// Write the index of a finished shard
+void                writeShardIndex(
+                    // Registration parameters
+                    const reg_params &params,
+                    // Band range of the shard
+                    struct image_subset range );
+
+// Assemble the partial cubes of all shards into the final output
+// (and diff) cube, reading and writing every file sequentially
+void                hyperspec_merge(
+                    // Header of the input image
+                    struct hyspex_header header,
+                    // Registration parameters
+                    reg_params params );
+
+#endif // SHARD_H_DEFINED
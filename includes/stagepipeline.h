@@ -0,0 +1,200 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef STAGEPIPELINE_H_DEFINED
+#define STAGEPIPELINE_H_DEFINED
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "workqueue.h"
+
+// =====================================================
+// Stage executor. Items flow through a fixed chain of
+// stages connected by bounded queues, each stage with
+// its own threads, so that I/O-bound and compute-bound
+// stages of different items overlap. Every stage counts
+// its busy time, the time spent waiting for input and
+// for room downstream, and the queue length it sees.
+// An exception thrown by a stage closes every queue, so
+// the other stages stop, and is rethrown by run.
+// =====================================================
+
+template <typename T>
+class StagePipeline {
+public:
+  explicit StagePipeline( size_t depth ) : depth( depth ), wall( 0.0 ) {}
+
+  // Append a stage. body( item, thread ) is called for every item, with
+  // the number of the stage thread calling it
+  void addStage( const std::string &name,
+                 int threads,
+                 std::function<void(T&, int)> body ){
+    Stage stage;
+    stage.name    = name;
+    stage.threads = threads < 1 ? 1 : threads;
+    stage.body    = body;
+    stages.push_back( stage );
+  }
+
+  // Most items between the first stage taking one and the last stage
+  // finishing it, with the stages added so far. A pool of this many
+  // buffers, taken by the first stage and returned by the last, is
+  // never empty when the first stage takes from it
+  size_t inFlight() const {
+    size_t total = 0;
+    for ( size_t k=0; k < stages.size(); k++ ){
+      total += stages[k].threads;
+    }
+    return total + ( stages.empty() ? 0 : depth*( stages.size() - 1 ) );
+  }
+
+  // Push all items through every stage, in order, and return when
+  // the last stage is done with the last item. The first exception
+  // thrown by a stage is rethrown once all stage threads have stopped
+  void run( std::vector<T> &items ){
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+
+    // Queue k feeds stage k
+    std::vector< std::unique_ptr< WorkQueue<T> > > queues;
+    for ( size_t k=0; k < stages.size(); k++ ){
+      queues.push_back( std::unique_ptr< WorkQueue<T> >( new WorkQueue<T>( depth ) ) );
+    }
+    std::vector< std::unique_ptr< std::atomic<int> > > running;
+    for ( size_t k=0; k < stages.size(); k++ ){
+      running.push_back( std::unique_ptr< std::atomic<int> >(
+        new std::atomic<int>( stages[k].threads ) ) );
+      stages[k].counters.assign( stages[k].threads, Counters() );
+    }
+
+    auto seconds = []( Clock::time_point from ){
+      return std::chrono::duration<double>( Clock::now() - from ).count();
+    };
+
+    std::mutex failLock;
+    std::exception_ptr failure;
+    std::atomic<bool> failed( false );
+
+    auto worker = [&]( size_t k, int t ){
+      Counters &count = stages[k].counters[t];
+      while ( true ){
+        Clock::time_point waitStart = Clock::now();
+        count.queued += queues[k]->size();
+        T item;
+        if ( !queues[k]->pop( item ) ){
+          break;
+        }
+        count.waitIn += seconds( waitStart );
+
+        Clock::time_point busyStart = Clock::now();
+        try {
+          stages[k].body( item, t );
+        } catch ( ... ){
+          std::lock_guard<std::mutex> lock( failLock );
+          if ( !failure ){
+            failure = std::current_exception();
+          }
+          failed = true;
+          for ( size_t q=0; q < queues.size(); q++ ){
+            queues[q]->close();
+          }
+        }
+        count.busy += seconds( busyStart );
+        if ( failed ){
+          break;
+        }
+        count.items++;
+
+        if ( k + 1 < stages.size() ){
+          Clock::time_point pushStart = Clock::now();
+          queues[k+1]->push( std::move( item ) );
+          count.waitOut += seconds( pushStart );
+        }
+      }
+      // The last thread out closes the next queue
+      if ( --(*running[k]) == 0 && k + 1 < stages.size() ){
+        queues[k+1]->close();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for ( size_t k=0; k < stages.size(); k++ ){
+      for ( int t=0; t < stages[k].threads; t++ ){
+        threads.push_back( std::thread( worker, k, t ) );
+      }
+    }
+    for ( size_t n=0; n < items.size(); n++ ){
+      if ( !queues[0]->push( std::move( items[n] ) ) ){
+        break;
+      }
+    }
+    queues[0]->close();
+    for ( size_t n=0; n < threads.size(); n++ ){
+      threads[n].join();
+    }
+    wall = seconds( start );
+    if ( failure ){
+      std::rethrow_exception( failure );
+    }
+  }
+
+  // Print busy, starved and blocked time of every stage in the last run.
+  // The busiest stage relative to its threads is the bottleneck
+  void printOccupancy() const {
+    std::cout << "Stage occupancy, " << wall << " s wall time:" << std::endl;
+    for ( size_t k=0; k < stages.size(); k++ ){
+      Counters total;
+      for ( size_t t=0; t < stages[k].counters.size(); t++ ){
+        total.items   += stages[k].counters[t].items;
+        total.busy    += stages[k].counters[t].busy;
+        total.waitIn  += stages[k].counters[t].waitIn;
+        total.waitOut += stages[k].counters[t].waitOut;
+        total.queued  += stages[k].counters[t].queued;
+      }
+      double capacity = wall*stages[k].threads;
+      std::cout << stages[k].name
+                << ": " << stages[k].threads << " threads"
+                << ", " << total.items << " items"
+                << ", " << ( capacity > 0.0 ? 100.0*total.busy/capacity : 0.0 ) << " % busy"
+                << ", " << ( capacity > 0.0 ? 100.0*total.waitIn/capacity : 0.0 ) << " % starved"
+                << ", " << ( capacity > 0.0 ? 100.0*total.waitOut/capacity : 0.0 ) << " % blocked"
+                << ", " << ( total.items > 0 ? (double)total.queued/total.items : 0.0 ) << " queued on average"
+                << std::endl;
+    }
+  }
+
+private:
+  struct Counters {
+    Counters() : items( 0 ), queued( 0 ), busy( 0.0 ), waitIn( 0.0 ), waitOut( 0.0 ) {}
+    size_t items;
+    size_t queued;
+    double busy;
+    double waitIn;
+    double waitOut;
+  };
+
+  struct Stage {
+    std::string name;
+    int threads;
+    std::function<void(T&, int)> body;
+    std::vector<Counters> counters;
+  };
+
+  size_t depth;
+  std::vector<Stage> stages;
+  double wall;
+};
+
+#endif // STAGEPIPELINE_H_DEFINED
@@ -0,0 +1,76 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#ifndef WORKQUEUE_H_DEFINED
+#define WORKQUEUE_H_DEFINED
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// =====================================================
+// Bounded blocking queue for handing work between
+// threads. Producers block while the queue is full, and
+// consumers block while it is empty.
+// =====================================================
+
+template <typename T>
+class WorkQueue {
+public:
+  explicit WorkQueue( size_t capacity ) : capacity( capacity ), closed( false ) {}
+
+  // Add item, waiting for room. Returns false if the queue is closed
+  bool push( T item ){
+    std::unique_lock<std::mutex> lock( mutex );
+    notFull.wait( lock, [this]{ return closed || items.size() < capacity; } );
+    if ( closed ){
+      return false;
+    }
+    items.push_back( std::move( item ) );
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Take item, waiting for one. Returns false once the queue
+  // is closed and drained
+  bool pop( T &item ){
+    std::unique_lock<std::mutex> lock( mutex );
+    notEmpty.wait( lock, [this]{ return closed || !items.empty(); } );
+    if ( items.empty() ){
+      return false;
+    }
+    item = std::move( items.front() );
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed, wake up everyone waiting
+  void close(){
+    std::lock_guard<std::mutex> lock( mutex );
+    closed = true;
+    notFull.notify_all();
+    notEmpty.notify_all();
+  }
+
+  // Number of queued items
+  size_t size(){
+    std::lock_guard<std::mutex> lock( mutex );
+    return items.size();
+  }
+
+private:
+  std::mutex              mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+  std::deque<T>           items;
+  size_t                  capacity;
+  bool                    closed;
+};
+
+#endif // WORKQUEUE_H_DEFINED
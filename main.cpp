@@ -5,35 +5,71 @@
 // http://opensource.org/licenses/MIT
 // =========================================================================
 
+#include <algorithm>
+#include <exception>
 #include <iostream>
 #include "string.h"
 #include "hyperspec.h"
 #include "multispec.h"
 #include "readimage.h"
+#include "batch.h"
+#include "daemon.h"
+#include <sys/stat.h>
 using namespace std;
 
 int main(int argc, char *argv[]){
 
+  // Options --key=value override key in params.conf, e.g. --workers=8.
+  // They are removed from the arguments before the inputs are handled
+  int nargs = 1;
+  for (int i=1; i < argc; i++){
+    if (strncmp(argv[i], "--", 2) == 0 && strchr(argv[i], '=') != NULL){
+      string option = argv[i] + 2;
+      string key = option.substr(0, option.find('='));
+      replace(key.begin(), key.end(), '-', '_');
+      if (!params_set(key, option.substr(option.find('=') + 1))){
+        cerr << "Unknown parameter: --" << key << endl;
+        exit(1);
+      }
+    } else {
+      argv[nargs++] = argv[i];
+    }
+  }
+  argc = nargs;
+
   if (argc < 2) {
-    cerr << "Usage: " << argv[0] << " hyperspectral_image_path" << endl;
+    cerr << "Usage: " << argv[0] << " [--key=value ...] hyperspectral_image_path | spool_directory" << endl;
     exit(1);
   }
 
   char *filename = argv[1];
 
   // File format recognition and run correct function
-  if (strstr(filename, "raw") ){
-    // File is .raw, see src/multispec.cpp
-    multispec_raw( argc, argv );
-  } else if (strstr(filename, "img") ){
-    // File is .img, see src/hyperspec.cpp
-    hyperspec_img(filename);
-  } else if (strstr(filename, "mat") ){
-    // File is .mat, see src/hyperspec.cpp
-    hyperspec_mat(filename);
-  } else {
-    // Unknown format
-    cerr << "Currently supported file formats: img, mat, raw" << endl;
+  struct stat info;
+  // Errors of a run are thrown up to here
+  try {
+    if (stat(filename, &info) == 0 && S_ISDIR(info.st_mode) ){
+      // Spool directory, see src/daemon.cpp
+      hyperspec_daemon( filename );
+    } else if (strstr(filename, ".batch") ){
+      // Manifest of cubes, see src/batch.cpp
+      hyperspec_batch( filename );
+    } else if (strstr(filename, "raw") ){
+      // File is .raw, see src/multispec.cpp
+      multispec_raw( argc, argv );
+    } else if (strstr(filename, "img") ){
+      // File is .img, see src/hyperspec.cpp
+      hyperspec_img(filename);
+    } else if (strstr(filename, "mat") ){
+      // File is .mat, see src/hyperspec.cpp
+      hyperspec_mat(filename);
+    } else {
+      // Unknown format
+      cerr << "Currently supported file formats: img, mat, raw, batch" << endl;
+      exit(1);
+    }
+  } catch ( std::exception &err ){
+    cerr << "Error: " << err.what() << endl;
     exit(1);
   }
 }
@@ -14,7 +14,9 @@ using namespace std;
 TransformAffineType::Pointer registration3(
                                         ImageType* const fixed,
                                         ImageType* const moving,
-                                        reg_params params ){
+                                        reg_params params,
+                                        TransformAffineType* const initial,
+                                        unsigned *iterations ){
 
   // Optimizer and Registration containers
   OptimizerType::Pointer          optimizer     = OptimizerType::New();
@@ -22,6 +24,7 @@ TransformAffineType::Pointer registration3(
                                         fixed,
                                         moving,
                                         optimizer );
+  setMetricSampling( registration.GetPointer(), params );
 
   // Construction of the transform object
   TransformAffineType::Pointer    transform     = TransformAffineType::New();
@@ -31,15 +34,20 @@ TransformAffineType::Pointer registration3(
                                         transform );
 
   // Set parameters
-  if (params.translation == 1 ){
-    CompositeTransformType::Pointer ttransform = translation(
-                                        fixed,
+  // Warm start from an already solved transform
+  if ( initial != NULL ){
+    transform->SetFixedParameters( initial->GetFixedParameters() );
+    transform->SetParameters( initial->GetParameters() );
+  }
+
+  CompositeTransformType::Pointer ttransform;
+  if ( params.translation >= 1 && initial == NULL ){
+    ttransform = initialTranslation(    fixed,
                                         moving,
                                         params );
     registration->SetMovingInitialTransform( ttransform );
-  } else {
-    registration->SetInitialTransform( transform );
   }
+  registration->SetInitialTransform( transform );
   registration->InPlaceOn();
 
   OptimizerScalesType optimizerScales( transform->GetNumberOfParameters() );
@@ -77,11 +85,19 @@ TransformAffineType::Pointer registration3(
     cout << "Optimizer stop condition: "
               << registration->GetOptimizer()->GetStopConditionDescription()
               << endl;
+    if ( iterations != NULL ){
+      *iterations = optimizer->GetCurrentIteration();
+    }
   }
   catch( itk::ExceptionObject & err ){
     cerr << "ExceptionObject caught !" << endl;
     cerr << err << endl;
-    exit(1);
+    throw;
+  }
+
+  // The returned transform includes the initial translation
+  if ( ttransform.IsNotNull() ){
+    composeTranslation( transform.GetPointer(), ttransform );
   }
 
   // Resample new image
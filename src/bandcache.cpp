@@ -0,0 +1,105 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "bandcache.h"
+#include <cstring>
+using namespace std;
+
+BandCache::BandCache()
+  : xsize( 0 ),
+    ysize( 0 ),
+    bandWriter( WRITE_DEPTH ){
+}
+
+void BandCache::reshape( unsigned xsize,
+                         unsigned ysize ){
+  lock_guard<mutex> guard( lock );
+  if ( xsize == this->xsize && ysize == this->ysize ){
+    return;
+  }
+  this->xsize = xsize;
+  this->ysize = ysize;
+  containers.clear();
+  filters.clear();
+}
+
+ImageType::Pointer BandCache::container( const string &role,
+                                         size_t slot ){
+  lock_guard<mutex> guard( lock );
+  ImageType::Pointer &image = containers[Key( role, slot )];
+  if ( image.IsNull() ){
+    ImageType::IndexType start;
+    start[0] = 0;
+    start[1] = 0;
+    ImageType::SizeType size;
+    size[0] = xsize;
+    size[1] = ysize;
+    ImageType::RegionType region;
+    region.SetSize( size );
+    region.SetIndex( start );
+
+    image = ImageType::New();
+    image->SetRegions( region );
+    image->Allocate();
+  }
+  return image;
+}
+
+ImageType::Pointer BandCache::copy( const string &role,
+                                    size_t slot,
+                                    ImageType* const band ){
+  ImageType::Pointer image = container( role, slot );
+  image->SetOrigin( band->GetOrigin() );
+  image->SetSpacing( band->GetSpacing() );
+  memcpy( image->GetBufferPointer(), band->GetBufferPointer(),
+    sizeof(float)*image->GetLargestPossibleRegion().GetNumberOfPixels() );
+  image->Modified();
+  return image;
+}
+
+ImageType::Pointer BandCache::filter( const string &role,
+                                      size_t slot,
+                                      ImageType* const band,
+                                      const reg_params &params,
+                                      int threads ){
+  if ( params.median != 1 && params.gradient != 1 ){
+    return band;
+  }
+
+  BandFilters *slotFilters;
+  {
+    lock_guard<mutex> guard( lock );
+    slotFilters = &filters[Key( role, slot )];
+  }
+
+  // The parameters are set on every band, a job may change them
+  ImageType::Pointer filtered = band;
+  if ( params.median == 1 ){
+    if ( slotFilters->median.IsNull() ){
+      slotFilters->median = MedianFilterType::New();
+    }
+    ImageType::SizeType radius;
+    radius[0] = params.radius;
+    radius[1] = params.radius;
+    slotFilters->median->SetRadius( radius );
+    slotFilters->median->SetInput( filtered );
+    setFilterThreads( slotFilters->median, threads );
+    slotFilters->median->Update();
+    filtered = slotFilters->median->GetOutput();
+  }
+  if ( params.gradient == 1 ){
+    if ( slotFilters->gradient.IsNull() ){
+      slotFilters->gradient = GradientFilterType::New();
+    }
+    slotFilters->gradient->SetSigma( params.sigma );
+    slotFilters->gradient->SetInput( filtered );
+    setFilterThreads( slotFilters->gradient, threads );
+    slotFilters->gradient->Update();
+    filtered = slotFilters->gradient->GetOutput();
+  }
+  return filtered;
+}
@@ -0,0 +1,199 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "bandpool.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double secondsSince( Clock::time_point start ){
+  return chrono::duration<double>( Clock::now() - start ).count();
+}
+
+BandPool::BandPool( int workers )
+  : workers( workers < 1 ? 1 : workers ),
+    wall( 0.0 ),
+    generation( 0 ),
+    active( 0 ),
+    quit( false ),
+    queues( this->workers ),
+    queueMutex( this->workers ),
+    job( NULL ),
+    stop( false ){
+
+  // A single worker runs on the calling thread
+  if ( this->workers > 1 ){
+    for ( int w=0; w < this->workers; w++ ){
+      threads.push_back( thread( &BandPool::work, this, w ) );
+    }
+  }
+}
+
+BandPool::~BandPool(){
+  {
+    lock_guard<std::mutex> lock( mutex );
+    quit = true;
+  }
+  started.notify_all();
+  for ( size_t w=0; w < threads.size(); w++ ){
+    threads[w].join();
+  }
+}
+
+int BandPool::size() const {
+  return workers;
+}
+
+void BandPool::run( const vector<int> &tasks,
+                    const function<void(int, int)> &job ){
+  run( tasks, vector<double>( tasks.size(), 1.0 ), job );
+}
+
+void BandPool::run( const vector<int> &tasks,
+                    const vector<double> &costs,
+                    const function<void(int, int)> &job ){
+
+  Clock::time_point start = Clock::now();
+  stats.assign( workers, WorkerStats() );
+  for ( int w=0; w < workers; w++ ){
+    stats[w].tasks  = 0;
+    stats[w].steals = 0;
+    stats[w].busy   = 0.0;
+  }
+
+  // Sequential, same as the plain loop
+  if ( workers == 1 ){
+    for ( size_t n=0; n < tasks.size(); n++ ){
+      job( 0, tasks[n] );
+    }
+    stats[0].tasks = tasks.size();
+    stats[0].busy  = wall = secondsSince( start );
+    return;
+  }
+
+  // Most expensive first. Each task goes to the worker with the least
+  // work dealt so far, and every queue stays sorted by cost
+  vector<size_t> byCost( tasks.size() );
+  for ( size_t n=0; n < byCost.size(); n++ ){
+    byCost[n] = n;
+  }
+  stable_sort( byCost.begin(), byCost.end(),
+    [&]( size_t a, size_t b ){ return costs[a] > costs[b]; } );
+
+  vector<double> dealt( workers, 0.0 );
+  for ( int w=0; w < workers; w++ ){
+    queues[w].clear();
+  }
+  for ( size_t n=0; n < byCost.size(); n++ ){
+    int w = min_element( dealt.begin(), dealt.end() ) - dealt.begin();
+    queues[w].push_back( tasks[byCost[n]] );
+    dealt[w] += costs[byCost[n]];
+  }
+
+  // Wake the workers and wait for all of them to run dry
+  exception_ptr failed;
+  {
+    unique_lock<std::mutex> lock( mutex );
+    this->job = &job;
+    stop      = false;
+    failure   = exception_ptr();
+    active    = workers;
+    generation++;
+    started.notify_all();
+    finished.wait( lock, [this]{ return active == 0; } );
+    this->job = NULL;
+    failed    = failure;
+  }
+  wall = secondsSince( start );
+
+  if ( failed ){
+    rethrow_exception( failed );
+  }
+}
+
+void BandPool::work( int w ){
+  long seen = 0;
+  while ( true ){
+    {
+      unique_lock<std::mutex> lock( mutex );
+      started.wait( lock, [&]{ return quit || generation != seen; } );
+      if ( quit ){
+        return;
+      }
+      seen = generation;
+    }
+
+    drain( w );
+
+    lock_guard<std::mutex> lock( mutex );
+    if ( --active == 0 ){
+      finished.notify_all();
+    }
+  }
+}
+
+void BandPool::drain( int w ){
+  while ( true ){
+    {
+      lock_guard<std::mutex> lock( mutex );
+      if ( stop ){
+        return;
+      }
+    }
+
+    // Own queue from the front, then steal from the back of the others
+    int task;
+    bool found = false;
+    for ( int k=0; k < workers && !found; k++ ){
+      int v = (w + k) % workers;
+      lock_guard<std::mutex> lock( queueMutex[v] );
+      if ( !queues[v].empty() ){
+        if ( v == w ){
+          task = queues[v].front();
+          queues[v].pop_front();
+        } else {
+          task = queues[v].back();
+          queues[v].pop_back();
+          stats[w].steals++;
+        }
+        found = true;
+      }
+    }
+    // No task is added during a run, so empty queues mean we are done
+    if ( !found ){
+      return;
+    }
+
+    Clock::time_point taskStart = Clock::now();
+    try {
+      (*job)( w, task );
+    } catch ( ... ){
+      lock_guard<std::mutex> lock( mutex );
+      if ( !failure ){
+        failure = current_exception();
+      }
+      stop = true;
+    }
+    stats[w].busy += secondsSince( taskStart );
+    stats[w].tasks++;
+  }
+}
+
+void BandPool::printUtilization() const {
+  cout << "Worker utilization, " << wall << " s wall time:" << endl;
+  for ( size_t w=0; w < stats.size(); w++ ){
+    cout  << "Worker " << w
+          << ": " << stats[w].tasks << " bands"
+          << ", " << stats[w].steals << " stolen"
+          << ", " << stats[w].busy << " s busy"
+          << ", " << ( wall > 0.0 ? 100.0*stats[w].busy/wall : 0.0 ) << " %"
+          << endl;
+  }
+}
@@ -0,0 +1,81 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "bandstore.h"
+#include "bandview.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+BandStore::BandStore( unsigned xsize,
+                      unsigned ysize,
+                      size_t slots )
+  : xsize( xsize ),
+    ysize( ysize ),
+    slots( slots ),
+    data( 2*(size_t)xsize*ysize*slots ),
+    read( slots ){
+}
+
+void BandStore::fill( const vector<int> &bands,
+                      const function<ImageType::Pointer(ImageType* const, int)> &readBand,
+                      reg_params params,
+                      BandPool &pool ){
+  if ( bands.size() > slots ){
+    cerr << "Band store holds " << slots << " bands, " << bands.size() << " given" << endl;
+    exit(1);
+  }
+
+  size_t pixels = (size_t)xsize*ysize;
+  slot.clear();
+  for ( size_t n=0; n < bands.size(); n++ ){
+    slot[bands[n]] = n;
+  }
+
+  // Contiguous groups of bands, one per worker, so that each worker
+  // reads neighbouring bands and the filters need no itk threads
+  int groups = max( 1, min( pool.size(), (int)bands.size() ) );
+  size_t perGroup = ( bands.size() + groups - 1 )/groups;
+  vector<int> tasks;
+  for ( int g=0; g < groups; g++ ){
+    tasks.push_back( g );
+  }
+
+  pool.run( tasks, [&]( int w, int g ){
+    size_t last = min( bands.size(), ( g + 1 )*perGroup );
+    for ( size_t n=g*perGroup; n < last; n++ ){
+      ImageType::Pointer container = wrapBand( &data[n*pixels], xsize, ysize );
+      ImageType::Pointer moving = readBand( container, bands[n] );
+      read[n] = moving;
+      ImageType::Pointer filtered = moving;
+      if ( params.median == 1){
+        filtered = medianFilter( filtered, params.radius, 1 );
+      }
+      if ( params.gradient == 1){
+        filtered = gradientFilter( filtered, params.sigma, 1 );
+      }
+      memcpy( &data[( slots + n )*pixels], filtered->GetBufferPointer(), pixels*sizeof(float) );
+    }
+  });
+}
+
+ImageType::Pointer BandStore::band( int i ) const {
+  map<int, size_t>::const_iterator found = slot.find( i );
+  if ( found == slot.end() ){
+    return NULL;
+  }
+  return wrapBand( const_cast<float*>( &data[( slots + found->second )*xsize*ysize] ), xsize, ysize );
+}
+
+ImageType::Pointer BandStore::moving( int i ) const {
+  map<int, size_t>::const_iterator found = slot.find( i );
+  if ( found == slot.end() ){
+    return NULL;
+  }
+  return read[found->second];
+}
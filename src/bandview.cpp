@@ -0,0 +1,83 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "bandview.h"
+#include <algorithm>
+#include <cstring>
+using namespace std;
+
+// Tile side for strided copies, 64x64 floats fit comfortably in L1/L2
+const size_t TILE_SIZE = 64;
+
+void copyStrided( const float *src,
+                  size_t srcRowStride,
+                  size_t srcColStride,
+                  float *dst,
+                  size_t dstRowStride,
+                  size_t dstColStride,
+                  size_t rows,
+                  size_t cols ){
+
+  // Contiguous rows in both buffers, one memcpy per row
+  if ( srcColStride == 1 && dstColStride == 1 ){
+    for ( size_t r=0; r < rows; r++ ){
+      memcpy( dst + r*dstRowStride, src + r*srcRowStride, sizeof(float)*cols );
+    }
+    return;
+  }
+
+  // Strided, i.e. transposing, copy in tiles
+  for ( size_t r0=0; r0 < rows; r0 += TILE_SIZE ){
+    size_t r1 = min( rows, r0 + TILE_SIZE );
+    for ( size_t c0=0; c0 < cols; c0 += TILE_SIZE ){
+      size_t c1 = min( cols, c0 + TILE_SIZE );
+      for ( size_t r=r0; r < r1; r++ ){
+        const float *srcRow = src + r*srcRowStride;
+        float       *dstRow = dst + r*dstRowStride;
+        for ( size_t c=c0; c < c1; c++ ){
+          dstRow[c*dstColStride] = srcRow[c*srcColStride];
+        }
+      }
+    }
+  }
+}
+
+ImageType::Pointer wrapBand( float *data,
+                             unsigned xsize,
+                             unsigned ysize ){
+  ImageType::RegionType region;
+  ImageType::IndexType start;
+
+  start[0] = 0;
+  start[1] = 0;
+
+  ImageType::SizeType size;
+  size[0] = xsize;
+  size[1] = ysize;
+
+  region.SetSize(size);
+  region.SetIndex(start);
+
+  ImageType::Pointer container = ImageType::New();
+  container->SetRegions(region);
+  // Let the pixel container point to the band, and leave the memory to the caller
+  container->GetPixelContainer()->SetImportPointer( data, xsize*ysize, false );
+  return container;
+}
+
+ImageType::Pointer copyBand( ImageType* const band ){
+  ImageType::RegionType region = band->GetLargestPossibleRegion();
+
+  ImageType::Pointer container = ImageType::New();
+  container->SetRegions(region);
+  container->SetOrigin( band->GetOrigin() );
+  container->SetSpacing( band->GetSpacing() );
+  container->Allocate();
+  memcpy( container->GetBufferPointer(), band->GetBufferPointer(),
+    sizeof(float)*region.GetNumberOfPixels() );
+  return container;
+}
@@ -0,0 +1,150 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "bandwriter.h"
+#include <stdexcept>
+using namespace std;
+
+BandWriter::BandWriter( size_t depth )
+  : hasDiff( false ),
+    bandSize( 0 ),
+    queue( depth ),
+    closed( true ),
+    flushed( true ){
+  thread = std::thread( &BandWriter::run, this );
+}
+
+BandWriter::BandWriter( const char *name,
+                        const char *diffName,
+                        struct hyspex_header header,
+                        interleave_t interleave,
+                        int datatype,
+                        size_t depth )
+  : BandWriter( depth ){
+  open( name, diffName, header, interleave, datatype );
+}
+
+BandWriter::~BandWriter(){
+  flush();
+  queue.close();
+  thread.join();
+}
+
+void BandWriter::open( const char *name,
+                       const char *diffName,
+                       struct hyspex_header header,
+                       interleave_t interleave,
+                       int datatype ){
+  flush();
+  hasDiff  = diffName != NULL;
+  bandSize = (size_t)header.samples*header.lines;
+
+  // Headers first, then the preallocated image files
+  hyperspectral_err_t errcode;
+  hyperspectral_write_header( name, header.bands, header.samples,
+    header.lines, header.wlens, interleave, datatype );
+  errcode = hyperspectral_create_image( name, header.bands, header.samples,
+    header.lines, interleave, datatype, &out );
+  if ( errcode == HYPERSPECTRAL_NO_ERR && hasDiff ){
+    hyperspectral_write_header( diffName, header.bands, header.samples,
+      header.lines, header.wlens, interleave, 4 );
+    errcode = hyperspectral_create_image( diffName, header.bands, header.samples,
+      header.lines, interleave, 4, &diff );
+    if ( errcode != HYPERSPECTRAL_NO_ERR ){
+      hyperspectral_close_image( &out );
+    }
+  }
+  if ( errcode != HYPERSPECTRAL_NO_ERR ){
+    throw runtime_error( "could not create output image " + string( name )
+                         + ", error " + to_string( errcode ) );
+  }
+  {
+    lock_guard<mutex> lock( flushLock );
+    error.clear();
+  }
+  closed = false;
+}
+
+void BandWriter::writeBand( int band,
+                            const float *outData,
+                            const float *diffData ){
+  {
+    lock_guard<mutex> lock( flushLock );
+    if ( !error.empty() ){
+      throw runtime_error( error );
+    }
+  }
+  BandJob job;
+  job.band = band;
+  job.out.assign( outData, outData + bandSize );
+  if ( hasDiff && diffData != NULL ){
+    job.diff.assign( diffData, diffData + bandSize );
+  }
+  queue.push( std::move( job ) );
+}
+
+void BandWriter::close(){
+  string message = flush();
+  if ( !message.empty() ){
+    throw runtime_error( message );
+  }
+}
+
+// Write all queued bands and close the files, returning the first
+// write error of the output, empty if there was none
+string BandWriter::flush(){
+  if ( closed ){
+    return "";
+  }
+  closed = true;
+
+  // Band -1 marks the end of the output, every band queued before it
+  // is on disk when the I/O thread gets to it
+  BandJob end;
+  end.band = -1;
+  {
+    lock_guard<mutex> lock( flushLock );
+    flushed = false;
+  }
+  queue.push( std::move( end ) );
+  unique_lock<mutex> lock( flushLock );
+  flushDone.wait( lock, [&]{ return flushed; } );
+
+  hyperspectral_close_image( &out );
+  if ( hasDiff ){
+    hyperspectral_close_image( &diff );
+  }
+  return error;
+}
+
+// I/O thread, positioned writes of every band as it arrives. After a
+// failed write the rest of the output is dropped
+void BandWriter::run(){
+  BandJob job;
+  bool failed = false;
+  while ( queue.pop( job ) ){
+    if ( job.band < 0 ){
+      lock_guard<mutex> lock( flushLock );
+      flushed = true;
+      failed  = false;
+      flushDone.notify_all();
+      continue;
+    }
+    if ( failed ){
+      continue;
+    }
+    hyperspectral_err_t errcode = hyperspectral_write_band( &out, job.band, &job.out[0] );
+    if ( errcode == HYPERSPECTRAL_NO_ERR && !job.diff.empty() ){
+      errcode = hyperspectral_write_band( &diff, job.band, &job.diff[0] );
+    }
+    if ( errcode != HYPERSPECTRAL_NO_ERR ){
+      lock_guard<mutex> lock( flushLock );
+      error  = "could not write band " + to_string( job.band ) + ", error " + to_string( errcode );
+      failed = true;
+    }
+  }
+}
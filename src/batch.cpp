@@ -0,0 +1,130 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "batch.h"
+#include "bandcache.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <thread>
+using namespace std;
+
+vector<struct batch_job> readManifest( const char *manifest ){
+  ifstream fid( manifest );
+  if ( !fid ){
+    cerr << "Could not open manifest " << manifest << endl;
+    exit(1);
+  }
+
+  vector<struct batch_job> jobs;
+  string line;
+  while ( getline( fid, line ) ){
+    istringstream fields( line );
+    struct batch_job job;
+    if ( !( fields >> job.input ) || job.input[0] == '#' ){
+      continue;
+    }
+    if ( !( fields >> job.reg_name ) ){
+      cerr << "Missing output name for " << job.input << " in " << manifest << endl;
+      exit(1);
+    }
+    if ( !( fields >> job.diff_name ) ){
+      job.diff_name = job.reg_name + "_diff";
+    }
+    jobs.push_back( job );
+  }
+  return jobs;
+}
+
+bool hasExtension( const string &path, const char *extension ){
+  size_t length = strlen( extension );
+  return path.size() > length
+      && path.compare( path.size() - length, length, extension ) == 0;
+}
+
+bool runBatchJob( const struct batch_job &job,
+                  reg_params params,
+                  BandPool &pool,
+                  BandCache &cache ){
+  params.reg_name  = job.reg_name;
+  params.diff_name = job.diff_name;
+
+  if ( hasExtension( job.input, ".img" ) ){
+    hyperspec_img( job.input.c_str(), params, pool, cache );
+  } else if ( hasExtension( job.input, ".mat" ) ){
+    hyperspec_mat( job.input.c_str(), params, pool, cache );
+  } else {
+    cerr << "Batch mode supports img and mat cubes, skipping " << job.input << endl;
+    return false;
+  }
+  return true;
+}
+
+void hyperspec_batch( const char *manifest ){
+
+  // Parameters and thread budget are set once for all cubes
+  struct reg_params params;
+  conf_err_t reg_errcode = params_read( &params );
+  vector<struct batch_job> jobs = readManifest( manifest );
+  if ( jobs.empty() ){
+    cerr << "No cubes in " << manifest << endl;
+    exit(1);
+  }
+
+  // The band workers are shared out between the cubes running at a time
+  int cubes   = max( 1, min( params.batch_cubes, (int)jobs.size() ) );
+  int workers = max( 1, params.workers / cubes );
+  cout  << "Batch of " << jobs.size() << " cubes, "
+        << cubes << " at a time with "
+        << workers << " band workers each" << endl;
+
+  vector<double> seconds( jobs.size(), 0.0 );
+  // 0 skipped, 1 done, 2 failed
+  vector<char> done( jobs.size(), 0 );
+  atomic<size_t> next( 0 );
+
+  // Every runner keeps its pool, band containers, filters and writer
+  // for all the cubes it registers
+  auto runner = [&](){
+    BandPool pool( workers );
+    BandCache cache;
+    size_t n;
+    while ( (n = next++) < jobs.size() ){
+      Clock::time_point start = Clock::now();
+      cout << "Cube " << n + 1 << " of " << jobs.size() << ": " << jobs[n].input << endl;
+      try {
+        done[n]  = runBatchJob( jobs[n], params, pool, cache ) ? 1 : 0;
+      } catch ( std::exception &err ){
+        cerr << "Cube " << jobs[n].input << " failed: " << err.what() << endl;
+        done[n]  = 2;
+      }
+      seconds[n] = secondsSince( start );
+    }
+  };
+
+  if ( cubes == 1 ){
+    runner();
+  } else {
+    vector<thread> runners;
+    for ( int c=0; c < cubes; c++ ){
+      runners.push_back( thread( runner ) );
+    }
+    for ( size_t c=0; c < runners.size(); c++ ){
+      runners[c].join();
+    }
+  }
+
+  cout << "Batch summary:" << endl;
+  for ( size_t n=0; n < jobs.size(); n++ ){
+    cout  << jobs[n].input << " -> " << jobs[n].reg_name << ": "
+          << ( done[n] == 1 ? "done" : done[n] == 2 ? "failed" : "skipped" ) << ", "
+          << seconds[n] << " s" << endl;
+  }
+}
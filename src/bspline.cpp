@@ -14,7 +14,8 @@ using namespace std;
 
 TransformBSplineType::Pointer registration4(  ImageType* const fixed,
                                               ImageType* const moving,
-                                              reg_params params){
+                                              reg_params params,
+                                              CompositeTransformType::Pointer *initial ){
 
   MetricType::Pointer                 metric        = MetricType::New();
   OptimizerBSplineType::Pointer       optimizer     = OptimizerBSplineType::New();
@@ -22,6 +23,7 @@ TransformBSplineType::Pointer registration4(  ImageType* const fixed,
 
   registration->SetMetric(        metric    );
   registration->SetOptimizer(     optimizer );
+  setMetricSampling( registration.GetPointer(), params );
 
   TransformBSplineType::Pointer  transform              = TransformBSplineType::New();
 
@@ -40,15 +42,19 @@ TransformBSplineType::Pointer registration4(  ImageType* const fixed,
 
   transform->SetIdentity();
 
-  if (params.translation == 1 ){
-    CompositeTransformType::Pointer ttransform = translation(
+  // A B-spline cannot hold the initial translation, it is handed back
+  // in initial to be applied after the B-spline
+  if (params.translation >= 1 ){
+    CompositeTransformType::Pointer ttransform = initialTranslation(
                                         fixed,
                                         moving,
                                         params );
     registration->SetMovingInitialTransform( ttransform );
-  } else {
-    registration->SetInitialTransform( transform );
+    if ( initial != NULL ){
+      *initial = ttransform;
+    }
   }
+  registration->SetInitialTransform( transform );
   registration->InPlaceOn();
   registration->SetFixedImage(    fixed     );
   registration->SetMovingImage(   moving    );
@@ -141,7 +147,7 @@ TransformBSplineType::Pointer registration4(  ImageType* const fixed,
     {
     cerr << "ExceptionObject caught !"  << endl;
     cerr << err                         << endl;
-    exit(1);
+    throw;
     }
 
   // Report the time and memory taken by the registration
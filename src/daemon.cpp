@@ -0,0 +1,332 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "daemon.h"
+#include "batch.h"
+#include "multispec.h"
+#include "workqueue.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <sys/file.h>
+#include <thread>
+#include <unistd.h>
+using namespace std;
+
+// Set by SIGINT and SIGTERM, the daemon finishes its claimed jobs
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop( int ){
+  stopRequested = 1;
+}
+
+// Spool file of a job with the given extension
+static string spoolFile( const string &spool, const string &name, const char *ext ){
+  return spool + "/" + name + ext;
+}
+
+// Rewrite the status file of a job. It is written aside and renamed,
+// so that a reader never sees half a status
+static void writeStatus( const string &spool,
+                         const struct daemon_job &job,
+                         const char *state,
+                         double seconds,
+                         const string &message ){
+  string path = spoolFile( spool, job.name, ".status" );
+  string temp = path + ".tmp";
+  ofstream fid( temp.c_str() );
+  fid << "state = " << state << endl;
+  for ( size_t n=0; n < job.cubes.size(); n++ ){
+    fid << "cube = " << job.cubes[n] << endl;
+  }
+  fid << "reg_name = " << job.reg_name << endl;
+  fid << "seconds = " << seconds << endl;
+  if ( !message.empty() ){
+    fid << "message = " << message << endl;
+  }
+  fid.close();
+  rename( temp.c_str(), path.c_str() );
+}
+
+// Lock a job file, returning the locked descriptor. -1 if the file is
+// gone or locked by another claim. The lock stays with the file when it
+// is renamed, and is released when the descriptor is closed or the
+// daemon holding it dies
+static int lockJob( const string &path ){
+  int fd = open( path.c_str(), O_RDONLY );
+  if ( fd < 0 ){
+    return -1;
+  }
+  if ( flock( fd, LOCK_EX | LOCK_NB ) != 0 ){
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+// Finish a claimed job, renaming it to <name><ext> before the lock is
+// released
+static void releaseJob( const string &spool, struct daemon_job &job, const char *ext ){
+  rename( spoolFile( spool, job.name, ".run" ).c_str(),
+          spoolFile( spool, job.name, ext ).c_str() );
+  if ( job.claim >= 0 ){
+    close( job.claim );
+    job.claim = -1;
+  }
+}
+
+// Names of the jobs with the given extension, oldest name first
+static vector<string> spoolJobs( const string &spool, const char *ext ){
+  size_t extLength = strlen( ext );
+  vector<string> names;
+  DIR *dir = opendir( spool.c_str() );
+  if ( dir == NULL ){
+    return names;
+  }
+  struct dirent *entry;
+  while ( (entry = readdir( dir )) != NULL ){
+    string file = entry->d_name;
+    if ( file.size() > extLength
+         && file.compare( file.size() - extLength, extLength, ext ) == 0 ){
+      names.push_back( file.substr( 0, file.size() - extLength ) );
+    }
+  }
+  closedir( dir );
+  sort( names.begin(), names.end() );
+  return names;
+}
+
+static string trim( const string &text ){
+  size_t first = text.find_first_not_of( " \t\r" );
+  if ( first == string::npos ){
+    return "";
+  }
+  size_t last = text.find_last_not_of( " \t\r" );
+  return text.substr( first, last - first + 1 );
+}
+
+bool readJob( const string &path, struct daemon_job &job, string &message ){
+  ifstream fid( path.c_str() );
+  if ( !fid ){
+    message = "could not open " + path;
+    return false;
+  }
+
+  string line;
+  while ( getline( fid, line ) ){
+    line = trim( line );
+    if ( line.empty() || line[0] == '#' || line.compare( 0, 2, "//" ) == 0 ){
+      continue;
+    }
+    size_t equals = line.find( '=' );
+    if ( equals == string::npos ){
+      message = "no = in line: " + line;
+      return false;
+    }
+    string key   = trim( line.substr( 0, equals ) );
+    string value = trim( line.substr( equals + 1 ) );
+    if ( key == "cube" ){
+      job.cubes.push_back( value );
+    } else if ( key == "config" ){
+      job.config = value;
+    } else if ( key == "reg_name" ){
+      job.reg_name = value;
+    } else if ( key == "diff_name" ){
+      job.diff_name = value;
+    } else if ( key == "workers" || key == "itk_threads" ||
+                key == "thread_budget" || key == "batch_cubes" ){
+      message = key + " is set by the daemon";
+      return false;
+    } else if ( params_known( key ) ){
+      job.overrides[key] = value;
+    } else {
+      message = "unknown key: " + key;
+      return false;
+    }
+  }
+
+  if ( job.cubes.empty() ){
+    message = "no cube given";
+    return false;
+  }
+  if ( job.cubes.size() > 1 && !hasExtension( job.cubes[0], ".raw" ) ){
+    message = "only raw jobs take more than one cube";
+    return false;
+  }
+  return true;
+}
+
+bool runJob( const struct daemon_job &job, BandPool &pool, BandCache &cache,
+             const struct reg_params &daemon, string &message ){
+
+  // The inputs are checked up front, for a clearer message than the
+  // error thrown by the reader
+  for ( size_t n=0; n < job.cubes.size(); n++ ){
+    if ( access( job.cubes[n].c_str(), R_OK ) != 0 ){
+      message = "cannot read " + job.cubes[n];
+      return false;
+    }
+  }
+  // A missing config would silently register with the default values
+  string config = job.config.empty() ? "params.conf" : job.config;
+  if ( !job.config.empty() && access( config.c_str(), R_OK ) != 0 ){
+    message = "cannot read " + config;
+    return false;
+  }
+
+  struct reg_params params;
+  conf_err_t reg_errcode = params_read( &params, config, job.overrides );
+  if ( reg_errcode == CONF_INVALID_VALUE ){
+    message = "invalid value in " + config + " or the job, see the log";
+    return false;
+  }
+  // The itk limits are global and were set once by the daemon, the
+  // job registers on its runner's share of the band workers
+  params.thread_budget = daemon.thread_budget;
+  params.itk_threads   = daemon.itk_threads;
+  params.workers       = pool.size();
+  if ( !job.reg_name.empty() ){
+    params.reg_name = job.reg_name;
+  }
+  if ( !job.diff_name.empty() ){
+    params.diff_name = job.diff_name;
+  }
+
+  try {
+    if ( hasExtension( job.cubes[0], ".raw" ) ){
+      // Frames are passed on as if given on the command line
+      vector<char*> argv( 1, (char*)"registration" );
+      for ( size_t n=0; n < job.cubes.size(); n++ ){
+        argv.push_back( (char*)job.cubes[n].c_str() );
+      }
+      multispec_raw( (int)argv.size(), argv.data(), params );
+    } else {
+      struct batch_job cube;
+      cube.input     = job.cubes[0];
+      cube.reg_name  = params.reg_name;
+      cube.diff_name = params.diff_name;
+      if ( !runBatchJob( cube, params, pool, cache ) ){
+        message = "unsupported format";
+        return false;
+      }
+    }
+  } catch ( std::exception &err ){
+    message = err.what();
+    return false;
+  }
+  return true;
+}
+
+void hyperspec_daemon( const char *spool ){
+
+  // The daemon's own config sizes the runners and their pools,
+  // jobs only change the registration parameters
+  struct reg_params params;
+  conf_err_t reg_errcode = params_read( &params );
+  int runners = max( 1, params.batch_cubes );
+  int workers = max( 1, params.workers / runners );
+
+  signal( SIGINT,  requestStop );
+  signal( SIGTERM, requestStop );
+
+  cout  << "Watching " << spool << " with "
+        << runners << " job runners of "
+        << workers << " band workers" << endl;
+
+  WorkQueue<struct daemon_job> queue( runners );
+  string spoolDir = spool;
+
+  // Claims whose lock is free were running when their daemon was
+  // killed, and may have left partial outputs, so they are failed rather
+  // than rerun. Jobs of other daemons on the spool are still locked
+  vector<string> stale = spoolJobs( spoolDir, ".run" );
+  for ( size_t n=0; n < stale.size(); n++ ){
+    struct daemon_job job;
+    job.name = stale[n];
+    string run = spoolFile( spoolDir, job.name, ".run" );
+    job.claim = lockJob( run );
+    if ( job.claim < 0 ){
+      continue;
+    }
+    string message;
+    readJob( run, job, message );
+    writeStatus( spoolDir, job, "failed", 0.0,
+                 "interrupted, its daemon stopped while running it" );
+    releaseJob( spoolDir, job, ".failed" );
+    cerr << "Job " << job.name << " was interrupted, marked failed" << endl;
+  }
+
+  auto runner = [&](){
+    BandPool pool( workers );
+    BandCache cache;
+    struct daemon_job job;
+    while ( queue.pop( job ) ){
+      string message;
+      writeStatus( spoolDir, job, "running", 0.0, message );
+      Clock::time_point start = Clock::now();
+      bool done = runJob( job, pool, cache, params, message );
+      double seconds = secondsSince( start );
+      writeStatus( spoolDir, job, done ? "done" : "failed", seconds, message );
+      releaseJob( spoolDir, job, done ? ".done" : ".failed" );
+      cout  << "Job " << job.name << ( done ? " done in " : " failed after " )
+            << seconds << " s" << ( message.empty() ? "" : ": " ) << message << endl;
+    }
+  };
+
+  vector<thread> threads;
+  for ( int r=0; r < runners; r++ ){
+    threads.push_back( thread( runner ) );
+  }
+
+  string stopFile = spoolDir + "/stop";
+  while ( !stopRequested && access( stopFile.c_str(), F_OK ) != 0 ){
+    vector<string> names = spoolJobs( spoolDir, ".job" );
+    for ( size_t n=0; n < names.size() && !stopRequested; n++ ){
+      // Locking and renaming claims the job, also against other daemons
+      // on the spool. The lock is taken first, so that a claim is never
+      // seen unlocked
+      struct daemon_job job;
+      job.name  = names[n];
+      job.claim = lockJob( spoolFile( spoolDir, names[n], ".job" ) );
+      if ( job.claim < 0 ){
+        continue;
+      }
+      string run = spoolFile( spoolDir, names[n], ".run" );
+      if ( rename( spoolFile( spoolDir, names[n], ".job" ).c_str(), run.c_str() ) != 0 ){
+        close( job.claim );
+        continue;
+      }
+      string message;
+      if ( !readJob( run, job, message ) ){
+        writeStatus( spoolDir, job, "failed", 0.0, message );
+        releaseJob( spoolDir, job, ".failed" );
+        cerr << "Job " << job.name << " rejected: " << message << endl;
+        continue;
+      }
+      writeStatus( spoolDir, job, "queued", 0.0, message );
+      queue.push( job );
+    }
+    if ( names.empty() ){
+      this_thread::sleep_for( chrono::seconds( 1 ) );
+    }
+  }
+
+  // Claimed jobs are finished before the daemon stops
+  cout << "Stopping, finishing " << queue.size() << " queued jobs" << endl;
+  unlink( stopFile.c_str() );
+  queue.close();
+  for ( size_t r=0; r < threads.size(); r++ ){
+    threads[r].join();
+  }
+}
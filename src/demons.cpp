@@ -1,4 +1,9 @@
 #include "registration.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
 using namespace std;
 
 class CommandIterationUpdate2 : public itk::Command{
@@ -25,6 +30,125 @@ class CommandIterationUpdate2 : public itk::Command{
 
 
 
+// Lines [first, first + count) of a band, as an image keeping the
+// index and physical position they have in the band
+static ImageType::Pointer bandStrip( ImageType* const band,
+                                     unsigned first,
+                                     unsigned count ){
+  ImageType::RegionType region = band->GetLargestPossibleRegion();
+  size_t samples = region.GetSize()[0];
+  region.SetIndex( 1, first );
+  region.SetSize(  1, count );
+
+  ImageType::Pointer strip = ImageType::New();
+  strip->SetRegions( region );
+  strip->SetSpacing(   band->GetSpacing()   );
+  strip->SetOrigin(    band->GetOrigin()    );
+  strip->SetDirection( band->GetDirection() );
+  strip->Allocate();
+  memcpy( strip->GetBufferPointer(), band->GetBufferPointer() + (size_t)first*samples,
+          (size_t)count*samples*sizeof(float) );
+  return strip;
+}
+
+// Demons on overlapping strips of demons_tile lines, run side by side on
+// itk_threads threads. The strip fields are blended into one field for the
+// whole band, with weights falling off linearly across each overlap
+static DisplacementFieldType::Pointer tiledDemons(
+                                      ImageType* const fixed,
+                                      ImageType* const moving,
+                                      reg_params params ){
+
+  ImageType::RegionType region = fixed->GetLargestPossibleRegion();
+  unsigned samples = region.GetSize()[0];
+  unsigned lines   = region.GetSize()[1];
+  unsigned tile    = params.demons_tile;
+  unsigned overlap = min( (unsigned)max( params.demons_overlap, 0 ), tile / 2 );
+  unsigned step    = tile - overlap;
+
+  vector<unsigned> starts;
+  for ( unsigned first=0; ; first += step ){
+    starts.push_back( first );
+    if ( first + tile >= lines ){
+      break;
+    }
+  }
+
+  DisplacementFieldType::Pointer field = DisplacementFieldType::New();
+  field->SetRegions(   region                );
+  field->SetSpacing(   fixed->GetSpacing()   );
+  field->SetOrigin(    fixed->GetOrigin()    );
+  field->SetDirection( fixed->GetDirection() );
+  field->Allocate();
+  VectorPixelType zero;
+  zero.Fill( 0.0 );
+  field->FillBuffer( zero );
+  vector<float> weights( lines, 0.0 );
+
+  mutex fieldLock;
+  size_t next = 0;
+  auto tileWorker = [&](){
+    while ( true ){
+      size_t t;
+      {
+        lock_guard<mutex> lock( fieldLock );
+        if ( next == starts.size() ){
+          return;
+        }
+        t = next++;
+      }
+      unsigned first = starts[t];
+      unsigned count = min( tile, lines - first );
+
+      DemonsFilterType::Pointer filter = DemonsFilterType::New();
+      filter->SetFixedImage(  bandStrip( fixed,  first, count ) );
+      filter->SetMovingImage( bandStrip( moving, first, count ) );
+      filter->SetNumberOfIterations( params.niter );
+      filter->SetStandardDeviations( 1.0 );
+      setFilterThreads( filter, 1 );
+      filter->Update();
+      const VectorPixelType *strip = filter->GetOutput()->GetBufferPointer();
+
+      // Lines near an edge shared with another strip count less
+      lock_guard<mutex> lock( fieldLock );
+      VectorPixelType *out = field->GetBufferPointer();
+      for ( unsigned y=0; y < count; y++ ){
+        float weight = 1.0;
+        if ( overlap > 0 && t > 0 ){
+          weight = min( weight, ( y + 0.5f )/overlap );
+        }
+        if ( overlap > 0 && t + 1 < starts.size() ){
+          weight = min( weight, ( count - y - 0.5f )/overlap );
+        }
+        weights[first + y] += weight;
+        VectorPixelType *row = out + (size_t)( first + y )*samples;
+        for ( unsigned x=0; x < samples; x++ ){
+          row[x] += strip[(size_t)y*samples + x]*weight;
+        }
+      }
+    }
+  };
+
+  unsigned tileWorkers = max( 1, min( params.itk_threads, (int)starts.size() ) );
+  vector<thread> threads;
+  for ( unsigned w=1; w < tileWorkers; w++ ){
+    threads.push_back( thread( tileWorker ) );
+  }
+  tileWorker();
+  for ( size_t w=0; w < threads.size(); w++ ){
+    threads[w].join();
+  }
+
+  VectorPixelType *out = field->GetBufferPointer();
+  for ( unsigned y=0; y < lines; y++ ){
+    VectorPixelType *row = out + (size_t)y*samples;
+    for ( unsigned x=0; x < samples; x++ ){
+      row[x] /= weights[y];
+    }
+  }
+  return field;
+}
+
 WarperType::Pointer registration5(
                                       ImageType* const fixed,
                                       ImageType* const moving,
@@ -36,6 +160,24 @@ WarperType::Pointer registration5(
   matcher->SetNumberOfHistogramLevels( 2048 );
   matcher->SetNumberOfMatchPoints( 9 );
   matcher->ThresholdAtMeanIntensityOn();
+
+  // Long bands are registered strip by strip, then warped as a whole
+  unsigned lines = fixed->GetLargestPossibleRegion().GetSize()[1];
+  if ( params.demons_tile > 0 && (unsigned)params.demons_tile < lines ){
+    matcher->Update();
+    DisplacementFieldType::Pointer field = tiledDemons( fixed, matcher->GetOutput(), params );
+
+    WarperType::Pointer warper = WarperType::New();
+    LinInterpolatorType::Pointer interpolator = LinInterpolatorType::New();
+    warper->SetInput( moving );
+    warper->SetInterpolator( interpolator );
+    warper->SetOutputSpacing( fixed->GetSpacing() );
+    warper->SetOutputOrigin( fixed->GetOrigin() );
+    warper->SetOutputDirection( fixed->GetDirection() );
+    warper->SetDisplacementField( field );
+    return warper;
+  }
+
   DemonsFilterType::Pointer filter = DemonsFilterType::New();
   CommandIterationUpdate2::Pointer observer = CommandIterationUpdate2::New();
   filter->AddObserver( itk::IterationEvent(), observer );
@@ -0,0 +1,62 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "framereader.h"
+#include <stdexcept>
+using namespace std;
+
+FrameReader::FrameReader( struct hyspex_header header,
+                          char *files[],
+                          int count,
+                          size_t depth )
+  : header( header ),
+    files( files ),
+    count( count ),
+    queue( depth ){
+  thread = std::thread( &FrameReader::run, this );
+}
+
+FrameReader::~FrameReader(){
+  queue.close();
+  thread.join();
+}
+
+bool FrameReader::nextFrame( int &i,
+                             ImageType::Pointer &frame ){
+  Frame next;
+  if ( !queue.pop( next ) ){
+    // Set before the queue was closed
+    if ( !error.empty() ){
+      throw runtime_error( error );
+    }
+    return false;
+  }
+  i = next.i;
+  frame = next.image;
+  return true;
+}
+
+// Reader thread. Every frame gets its own image, so a frame is never
+// overwritten while it is being registered
+void FrameReader::run(){
+  for ( int i=0; i < count; i++ ){
+    Frame next;
+    next.i = i;
+    next.image = imgContainer( header.samples, header.lines );
+    try {
+      readRaw( next.image, header, files[i] );
+    } catch ( std::exception &err ){
+      error = err.what();
+      break;
+    }
+
+    if ( !queue.push( next ) ){
+      break;
+    }
+  }
+  queue.close();
+}
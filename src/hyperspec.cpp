@@ -8,220 +8,1253 @@
 #include "readimage.h"
 #include "registration.h"
 #include "hyperspec.h"
+#include "bandview.h"
+#include "bandwriter.h"
+#include "matreader.h"
+#include "matwriter.h"
+#include "bandpool.h"
+#include "shard.h"
+#include "stagepipeline.h"
+#include "bandstore.h"
+#include "bandcache.h"
+#include "phasecorrelation.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "itkConfigure.h"
+#if ITK_VERSION_MAJOR >= 5
+#include "itkMultiThreaderBase.h"
+typedef itk::MultiThreaderBase ThreaderType;
+#else
+#include "itkMultiThreader.h"
+typedef itk::MultiThreader ThreaderType;
+#endif
 using namespace std;
 
+// Runs a cleanup when the scope is left, also by an exception
+class ScopeRelease {
+public:
+  ScopeRelease( const function<void()> &release ) : release( release ) {}
+  ~ScopeRelease(){ release(); }
+private:
+  function<void()> release;
+};
+
 void hyperspec_img(const char *filename){
 
   // Read parameters config
   struct reg_params params;
   conf_err_t reg_errcode = params_read( &params );
 
+  BandPool pool( params.workers );
+  BandCache cache;
+  hyperspec_img( filename, params, pool, cache );
+}
+
+void hyperspec_img( const char *filename,
+                    reg_params params,
+                    BandPool &pool,
+                    BandCache &cache ){
+
   // Read hyperspectral header file
   // See readimage.h for possible error codes.
   struct hyspex_header header;
   hyperspectral_err_t hyp_errcode
     = hyperspectral_read_header(filename, &header);
+  if ( hyp_errcode != HYPERSPECTRAL_NO_ERR ){
+    throw runtime_error( string( "could not read the header of " ) + filename
+                         + ", error " + to_string( hyp_errcode ) );
+  }
+
+  // Assemble the partial cubes of a sharded run
+  if ( params.merge == 1 ){
+    hyperspec_merge( header, params );
+    return;
+  }
+
+  // Register band by band straight to disk
+  if ( params.streaming == 1 ){
+    hyperspec_stream( filename, header, params, pool, cache );
+    return;
+  }
 
   // Read hyperspectral image
-  float *img  = new float[header.samples*header.lines*header.bands]();
-  hyp_errcode = hyperspectral_read_image(filename, &header, img);
+  // Memory-mapped images are converted band by band when touched
+  struct hyperspectral_mmap image;
+  float *img  = NULL;
+  if ( params.mmap == 1 ){
+    hyp_errcode = hyperspectral_mmap_image(filename, &header, &image);
+    if ( hyp_errcode != HYPERSPECTRAL_NO_ERR ){
+      throw runtime_error( string( "could not map " ) + filename
+                           + ", error " + to_string( hyp_errcode ) );
+    }
+  } else {
+    img = new float[header.samples*header.lines*header.bands]();
+    hyp_errcode = hyperspectral_read_image(filename, &header, img);
+  }
 
-  // Float container for output images
-  float *out  = new float[header.samples*header.lines*header.bands]();
-  // Float container for output images that show diff between input and output
-  float *diff = new float[header.samples*header.lines*header.bands]();
+  // Clear memory when done, or when a band fails
+  ScopeRelease release( [&](){
+    if ( params.mmap == 1 ){
+      hyperspectral_unmap_image(&image);
+    } else {
+      delete [] img;
+    }
+  });
+  if ( hyp_errcode != HYPERSPECTRAL_NO_ERR ){
+    throw runtime_error( string( "could not read " ) + filename
+                         + ", error " + to_string( hyp_errcode ) );
+  }
+
+  // Output containers on disk, each band is written by a background
+  // thread as soon as it is registered. A shard writes only its own bands
+  struct image_subset shard = shardRange( params, header );
+  string regName  = shardName( params.reg_name, params );
+  string diffName = shardName( params.diff_name, params );
+  cache.reshape( header.samples, header.lines );
+  BandWriter &writer = cache.writer();
+  writer.open( regName.c_str(), diffOutputName( params ) ? diffName.c_str() : NULL,
+    shardHeader( header, shard ), params.interleave, outputDatatype( params, header ) );
 
   // Create itk image pointers
-  // Input images
-  ImageType::Pointer fixed     = imageContainer(header);
-  ImageType::Pointer moving    = imageContainer(header);
-  // Filtered images
-  ImageType::Pointer ffixed    = imageContainer(header);
-  ImageType::Pointer fmoving   = imageContainer(header);
-  // Output images
-  ImageType::Pointer output    = imageContainer(header);
-  ImageType::Pointer outdiff   = imageContainer(header);
-  // Difference image
-  DifferenceFilterType::Pointer difference = DifferenceFilterType::New();
-  // Resample image
-  ResampleFilterType::Pointer       registration;
+  ImageType::Pointer fixed     = cache.container( "fixed", 0 );
+  ImageType::Pointer ffixed;
 
   // Read fixed image
-  int i = header.bands / 2;
-  fixed = readITK( fixed, img, i, header );
+  int center = header.bands / 2;
+  if ( params.mmap == 1 ){
+    fixed = readITK( fixed, &image, center );
+  } else {
+    fixed = readITK( fixed, img, center, header );
+  }
 
   // Filter image
-  ffixed = fixed;
-  if (params.median == 1){
-    ffixed = medianFilter( ffixed, params.radius );
-    ffixed->Update();
-  }
-  if (params.gradient == 1){
-    ffixed = gradientFilter( ffixed, params.sigma );
-    ffixed->Update();
-  }
-
-  WarperType::Pointer warper = WarperType::New();
-  // Read images for processing
-  // Image i=0 is fixed
-  for (int i=0; i < header.bands; i++){
-
-    // Read moving image
-    moving = readITK( moving, img, i, header );
-
-    // Skip center band (fixed)
-    if ( i == header.bands/2 ){
-      out = writeITK( moving, out, i, header );
-      continue;
-    }
-
-    // Filter images
-    fmoving = moving;
-    if ( params.median == 1){
-      fmoving = medianFilter( fmoving, params.radius );
-      fmoving->Update();
-    }
-    if ( params.gradient == 1){
-      fmoving = gradientFilter( fmoving, params.sigma );
-      fmoving->Update();
-    }
-
-    // Throw to registration handler
-    // Rigid transform
-    if (params.regmethod == 1){
-      TransformRigidType::Pointer       rigid_transform;
-      rigid_transform = registration1(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleRigidPointer(
-                                  fixed,
-                                  moving,
-                                  rigid_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-      // Similarity transform
-    } else if (params.regmethod == 2){
-      TransformSimilarityType::Pointer  similarity_transform;
-      similarity_transform = registration2(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleSimilarityPointer(
-                                  fixed,
-                                  moving,
-                                  similarity_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-      // Affine transform
-    } else if (params.regmethod == 3){
-      TransformAffineType::Pointer      affine_transform;
-      affine_transform = registration3(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleAffinePointer(
-                                  fixed,
-                                  moving,
-                                  affine_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-      // BSpline transform
-    } else if (params.regmethod == 4){
-      TransformBSplineType::Pointer      bspline_transform;
-      bspline_transform = registration4(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleBSplinePointer(
-                                  fixed,
-                                  moving,
-                                  bspline_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-    } else if (params.regmethod == 5){
-      CompositeTransformType::Pointer translation_transform;
-      translation_transform = translation(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-
-      ResampleFilterType::Pointer resample = ResampleFilterType::New();
-      resample->SetTransform(          translation_transform          );
-      resample->SetInput(                     moving                  );
-      resample->SetSize(  fixed->GetLargestPossibleRegion().GetSize() );
-      resample->SetOutputOrigin(         fixed->GetOrigin()           );
-      resample->SetOutputSpacing(        fixed->GetSpacing()          );
-      resample->SetDefaultPixelValue(               0.0               );
-      registration = resample;
-
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-    } else if (params.regmethod == 6){
-      warper = registration5(
-                                  fixed,
-                                  moving,
-                                  params );
-    }
-
-    // Add to output containers
-    if (params.regmethod == 6){
-      output = warper->GetOutput();
-      output->Update();
-    } else {
-      output = registration->GetOutput();
-      output->Update();
+  ffixed = filterBand( fixed, params );
+
+  // Center band (fixed) is written as is
+  if ( center >= shard.start_band && center < shard.end_band ){
+    writer.writeBand( center - shard.start_band, fixed->GetBufferPointer(), NULL );
+  }
 
-      outdiff = difference->GetOutput();
-      outdiff->Update();
+  // Register all other bands of the shard
+  vector<int> bands;
+  for (int i=shard.start_band; i < shard.end_band; i++){
+    if ( i != center ){
+      bands.push_back( i );
     }
+  }
+  registerBands( bands, fixed, ffixed,
+    [&]( ImageType* const container, int i ) -> ImageType::Pointer {
+      if ( params.mmap == 1 ){
+        return readITK( container, &image, i );
+      }
+      return readITK( container, img, i, header );
+    },
+    writer, shard.start_band, header, params, pool, cache );
+
+  // Wait for the last bands to reach the disk
+  writer.close();
+  writeShardIndex( params, shard );
+}
+
+void hyperspec_stream(  const char *filename,
+                        struct hyspex_header header,
+                        reg_params params,
+                        BandPool &pool,
+                        BandCache &cache ){
+
+  // Bands are read from the mapping when they are needed
+  struct hyperspectral_mmap image;
+  hyperspectral_err_t hyp_errcode = hyperspectral_mmap_image(filename, &header, &image);
+  if ( hyp_errcode != HYPERSPECTRAL_NO_ERR ){
+    throw runtime_error( string( "could not map " ) + filename
+                         + ", error " + to_string( hyp_errcode ) );
+  }
+  ScopeRelease release( [&](){ hyperspectral_unmap_image( &image ); } );
+
+  // Output containers on disk, written as soon as a band is done
+  struct image_subset shard = shardRange( params, header );
+  string regName  = shardName( params.reg_name, params );
+  string diffName = shardName( params.diff_name, params );
+  cache.reshape( header.samples, header.lines );
+  BandWriter &writer = cache.writer();
+  writer.open( regName.c_str(), diffOutputName( params ) ? diffName.c_str() : NULL,
+    shardHeader( header, shard ), params.interleave, outputDatatype( params, header ) );
+
+  // Only the fixed band and the bands being registered are held in memory
+  ImageType::Pointer fixed     = cache.container( "fixed", 0 );
+  ImageType::Pointer ffixed;
+
+  // Read and filter fixed image
+  int center = header.bands / 2;
+  fixed  = readITK( fixed, &image, center );
+  ffixed = filterBand( fixed, params );
+
+  // Center band (fixed) is written as is, its diff is left at zero
+  if ( center >= shard.start_band && center < shard.end_band ){
+    writer.writeBand( center - shard.start_band, fixed->GetBufferPointer(), NULL );
+  }
 
-    // Update output array(s)
-    out = writeITK( output, out, i, header );
-    if ( params.diff_conf == 1 && params.regmethod != 6){
-      diff = writeITK( outdiff, diff, i, header );
+  // One band in memory per worker, or per pipeline slot
+  vector<int> bands;
+  for (int i=shard.start_band; i < shard.end_band; i++){
+    if ( i != center ){
+      bands.push_back( i );
     }
+  }
+  registerBands( bands, fixed, ffixed,
+    [&]( ImageType* const container, int i ) -> ImageType::Pointer {
+      return readITK( container, &image, i );
+    },
+    writer, shard.start_band, header, params, pool, cache );
+
+  // Cleanup, the mapping is released on return
+  writer.close();
+  writeShardIndex( params, shard );
+}
+
+// Register a chunk of bands, taking the bands and filtered bands from store
+// if given
+static void registerChunk(  const vector<int> &bands,
+                            ImageType* const fixed,
+                            ImageType* const ffixed,
+                            const function<ImageType::Pointer(ImageType* const, int)> &readBand,
+                            const BandStore *store,
+                            BandWriter &writer,
+                            int firstBand,
+                            struct hyspex_header header,
+                            reg_params params,
+                            BandPool &pool,
+                            BandCache &cache,
+                            vector<double> &seconds ){
+
+  int center = header.bands / 2;
+  vector<double> costs = bandCosts( params, bands, center );
+
+  // Every worker has its own fixed images and moving container
+  vector<ImageType::Pointer> fixedw, ffixedw, movingw;
+  for (int w=0; w < pool.size(); w++){
+    fixedw.push_back(  cache.copy( "worker fixed", w, fixed )  );
+    ffixedw.push_back( cache.copy( "worker ffixed", w, ffixed ) );
+    movingw.push_back( cache.container( "moving", w ) );
+  }
+
+  if ( params.pipeline != 1 ){
+    // Spread over the workers, most expensive first
+    pool.run( bands, costs, [&]( int w, int i ){
+
+      Clock::time_point start = Clock::now();
+      ImageType::Pointer moving;
+      ImageType::Pointer fmoving;
+      ImageType::Pointer output;
+      ImageType::Pointer outdiff;
+
+      // Read moving image
+      moving = store ? store->moving( i ) : readBand( movingw[w], i );
 
-    // Uncomment for writing to .tif
+      // Filter images
+      fmoving = store ? store->band( i ) : cache.filter( "moving", w, moving, params );
+
+      // Throw to registration handler
+      registerBand( fixedw[w], ffixedw[w], moving, fmoving, params, output, outdiff );
+
+      // Hand output band(s) to the writer
+      writer.writeBand( i - firstBand, output->GetBufferPointer(),
+        outdiff.IsNotNull() ? outdiff->GetBufferPointer() : NULL );
+
+      // Uncomment for writing to .tif
 /*
-    WriterType::Pointer writer = WriterType::New();
-    string name = params.reg_name;
-    name += to_string(i);
-    name += ".tif";
-    writer->SetFileName( name );
-    writer->SetInput( warper->GetOutput() );
-    //writer->SetInput( moving );
-    writer->Update();
+      WriterType::Pointer writer = WriterType::New();
+      string name = params.reg_name;
+      name += to_string(i);
+      name += ".tif";
+      writer->SetFileName( name );
+      writer->SetInput( output );
+      //writer->SetInput( moving );
+      writer->Update();
 */
 
-    cout << "Done with " << i + 1 << " of " << header.bands << endl;
+      seconds[i] = secondsSince( start );
+      bandDone( i, header.bands );
+    });
+    pool.printUtilization();
+    return;
+  }
+
+  // Stage pipeline. The cheaper stages run on one itk thread each and
+  // are taken out of the band workers, so that the stages together stay
+  // within the thread budget. Reading and writing wait on the disk and
+  // are not counted
+  struct BandItem {
+    int band;
+    ImageType::Pointer container;
+    ImageType::Pointer moving;
+    ImageType::Pointer fmoving;
+    ImageType::Pointer output;
+    ImageType::Pointer outdiff;
+    struct band_transform transform;
+  };
+  int helpers   = max( 1, pool.size() / 8 );
+  int registers = max( 1, ( pool.size()*params.itk_threads - 2*helpers - 1 )
+                          / max( 1, params.itk_threads ) );
+  cout  << "Pipeline: " << registers << " register threads, "
+        << helpers << " prefilter and resample threads" << endl;
+  vector<ImageType::Pointer> fixedr;
+  for (int t=0; t < helpers; t++){
+    fixedr.push_back( cache.copy( "resample fixed", t, fixed ) );
+  }
+
+  // Moving containers go round from the read stage to the write stage
+  WorkQueue<ImageType::Pointer> containers( bands.size() + 1 );
+  StagePipeline<BandItem> pipeline( params.pipeline_depth );
+  pipeline.addStage( "read", 1, [&]( BandItem &item, int t ){
+    containers.pop( item.container );
+    item.moving = store ? store->moving( item.band ) : readBand( item.container, item.band );
+  });
+  pipeline.addStage( "prefilter", helpers, [&]( BandItem &item, int t ){
+    item.fmoving = store ? store->band( item.band ) : filterBand( item.moving, params, 1 );
+  });
+  pipeline.addStage( "register", registers, [&]( BandItem &item, int t ){
+    Clock::time_point start = Clock::now();
+    item.transform = solveBand( fixedw[t], ffixedw[t], item.moving, item.fmoving, params );
+    seconds[item.band] = secondsSince( start );
+  });
+  pipeline.addStage( "resample", helpers, [&]( BandItem &item, int t ){
+    resampleBand( fixedr[t], item.moving, item.transform, params, item.output, 1 );
+  });
+  pipeline.addStage( "diff", 1, [&]( BandItem &item, int t ){
+    diffBand( item.moving, item.output, params, item.outdiff, 1 );
+  });
+  pipeline.addStage( "write", 1, [&]( BandItem &item, int t ){
+    writer.writeBand( item.band - firstBand, item.output->GetBufferPointer(),
+      item.outdiff.IsNotNull() ? item.outdiff->GetBufferPointer() : NULL );
+    bandDone( item.band, header.bands );
+    containers.push( item.container );
+  });
+  for (size_t n=0; n < pipeline.inFlight() && n < bands.size(); n++){
+    containers.push( cache.container( "pipeline", n ) );
+  }
+
+  // Most expensive bands enter first
+  vector<size_t> byCost( bands.size() );
+  for (size_t n=0; n < byCost.size(); n++){
+    byCost[n] = n;
+  }
+  stable_sort( byCost.begin(), byCost.end(),
+    [&]( size_t a, size_t b ){ return costs[a] > costs[b]; } );
+  vector<BandItem> items( bands.size() );
+  for (size_t n=0; n < byCost.size(); n++){
+    items[n].band = bands[byCost[n]];
+  }
+
+  pipeline.run( items );
+  pipeline.printOccupancy();
+}
+
+// Bands on each side of the center band, ordered by their distance in
+// wavelength from it and split into segments of neighbouring bands
+static vector< vector<int> > spectralChains( const vector<int> &bands,
+                                             struct hyspex_header header,
+                                             int segments ){
+  int center = header.bands / 2;
+  bool wavelengths = (int)header.wlens.size() == header.bands;
+  auto wavelength = [&]( int i ){
+    return wavelengths ? (double)header.wlens[i] : (double)i;
+  };
+
+  vector<int> below, above;
+  for (size_t n=0; n < bands.size(); n++){
+    if ( wavelength( bands[n] ) < wavelength( center ) ){
+      below.push_back( bands[n] );
+    } else {
+      above.push_back( bands[n] );
+    }
+  }
+  auto outward = [&]( int a, int b ){
+    return fabs( wavelength( a ) - wavelength( center ) )
+         < fabs( wavelength( b ) - wavelength( center ) );
+  };
+  stable_sort( below.begin(), below.end(), outward );
+  stable_sort( above.begin(), above.end(), outward );
+
+  vector< vector<int> > chains;
+  const vector<int> *sides[2] = { &below, &above };
+  for (int k=0; k < 2; k++){
+    const vector<int> &side = *sides[k];
+    size_t length = ( side.size() + segments - 1 )/segments;
+    for (size_t first=0; first < side.size(); first += length){
+      chains.push_back( vector<int>( side.begin() + first,
+        side.begin() + min( first + length, side.size() ) ) );
+    }
+  }
+  return chains;
+}
+
+// Spectral walk. Each side of the center band is walked outward from
+// pivot bands spread along it. The pivots are solved first, each from the
+// pivot inside it, which is the nearest band registered by then, and only
+// the two bands next to the center start cold. Every other band starts
+// from its spectral neighbour: the bands between two pivots are walked
+// outward from the inner pivot and inward from the outer one, all these
+// chains side by side
+static void registerWalk( const vector<int> &bands,
+                          ImageType* const fixed,
+                          ImageType* const ffixed,
+                          const function<ImageType::Pointer(ImageType* const, int)> &readBand,
+                          BandWriter &writer,
+                          int firstBand,
+                          struct hyspex_header header,
+                          reg_params params,
+                          BandPool &pool,
+                          BandCache &cache,
+                          vector<double> &seconds ){
+
+  // Up to one chain per two workers on each side, as every pivot but the
+  // last starts two chains. The p pivots of a side of n bands take p steps
+  // before the chains of about n/2p bands start, least for p = sqrt(n/2)
+  vector< vector<int> > sides = spectralChains( bands, header, 1 );
+  struct WalkChain {
+    // Band the chain starts from
+    int         pivot;
+    // Bands in the order walked
+    vector<int> bands;
+  };
+  vector< vector<int> > pivots;
+  vector<WalkChain> chains;
+  for (size_t k=0; k < sides.size(); k++){
+    const vector<int> &side = sides[k];
+    int count = max( 1, min( ( pool.size() / 2 + 1 ) / 2, (int)sqrt( side.size() / 2.0 ) ) );
+    size_t spacing = ( side.size() + count - 1 )/count;
+    vector<size_t> at;
+    for (size_t n=0; n < side.size(); n += spacing){
+      at.push_back( n );
+    }
+    pivots.push_back( vector<int>() );
+    for (size_t j=0; j < at.size(); j++){
+      pivots.back().push_back( side[at[j]] );
+      // Outward up to halfway to the next pivot, inward from it for the rest
+      size_t next = j + 1 < at.size() ? at[j+1] : side.size();
+      size_t half = j + 1 < at.size() ? at[j] + ( next - at[j] )/2 : next - 1;
+      WalkChain outward;
+      outward.pivot = side[at[j]];
+      for (size_t n=at[j] + 1; n <= half; n++){
+        outward.bands.push_back( side[n] );
+      }
+      if ( !outward.bands.empty() ){
+        chains.push_back( outward );
+      }
+      if ( j + 1 < at.size() ){
+        WalkChain inward;
+        inward.pivot = side[next];
+        for (size_t n=next - 1; n > half; n--){
+          inward.bands.push_back( side[n] );
+        }
+        if ( !inward.bands.empty() ){
+          chains.push_back( inward );
+        }
+      }
+    }
+  }
+
+  vector<ImageType::Pointer> fixedw, ffixedw, movingw;
+  for (int w=0; w < pool.size(); w++){
+    fixedw.push_back(  cache.copy( "worker fixed", w, fixed )  );
+    ffixedw.push_back( cache.copy( "worker ffixed", w, ffixed ) );
+    movingw.push_back( cache.container( "moving", w ) );
+  }
+
+  vector<unsigned> iterations( header.bands, 0 );
+  vector<char> cold( header.bands, 0 );
+  auto walkBand = [&]( int w, int i, const struct band_transform *seed ){
+    Clock::time_point start = Clock::now();
+    ImageType::Pointer moving = readBand( movingw[w], i );
+    ImageType::Pointer fmoving = cache.filter( "moving", w, moving, params );
+    ImageType::Pointer output;
+    ImageType::Pointer outdiff;
+
+    struct band_transform transform = solveBand( fixedw[w], ffixedw[w], moving, fmoving,
+      params, seed );
+    resampleBand( fixedw[w], moving, transform, params, output );
+    diffBand( moving, output, params, outdiff );
+    writer.writeBand( i - firstBand, output->GetBufferPointer(),
+      outdiff.IsNotNull() ? outdiff->GetBufferPointer() : NULL );
+
+    iterations[i] = transform.iterations;
+    cold[i]       = seed == NULL;
+    seconds[i]    = secondsSince( start );
+    bandDone( i, header.bands );
+    return transform;
+  };
+
+  // Pivots, one side per task, walking outward
+  vector<struct band_transform> solved( header.bands );
+  vector<int> tasks;
+  for (size_t k=0; k < pivots.size(); k++){
+    tasks.push_back( k );
+  }
+  pool.run( tasks, [&]( int w, int k ){
+    for (size_t j=0; j < pivots[k].size(); j++){
+      solved[pivots[k][j]] = walkBand( w, pivots[k][j],
+        j == 0 ? NULL : &solved[pivots[k][j-1]] );
+    }
+  });
+
+  // The chains between the pivots
+  vector<double> costs;
+  tasks.clear();
+  for (size_t c=0; c < chains.size(); c++){
+    tasks.push_back( c );
+    costs.push_back( chains[c].bands.size() );
+  }
+  pool.run( tasks, costs, [&]( int w, int c ){
+    struct band_transform previous = solved[chains[c].pivot];
+    for (size_t n=0; n < chains[c].bands.size(); n++){
+      previous = walkBand( w, chains[c].bands[n], &previous );
+    }
+  });
+  pool.printUtilization();
+
+  // Iterations per band, in band order, so the savings of the warm starts show
+  unsigned warmTotal = 0, coldTotal = 0, warmBands = 0, coldBands = 0;
+  cout << "Spectral walk iterations:" << endl;
+  for (size_t n=0; n < bands.size(); n++){
+    int i = bands[n];
+    cout << "Band " << i;
+    if ( (int)header.wlens.size() == header.bands ){
+      cout << " (" << header.wlens[i] << ")";
+    }
+    cout << ": " << iterations[i] << ( cold[i] ? ", cold start" : "" ) << endl;
+    if ( cold[i] ){
+      coldTotal += iterations[i];
+      coldBands++;
+    } else {
+      warmTotal += iterations[i];
+      warmBands++;
+    }
+  }
+  cout  << "Average iterations, cold start: "
+        << ( coldBands > 0 ? (double)coldTotal/coldBands : 0.0 )
+        << ", warm start: "
+        << ( warmBands > 0 ? (double)warmTotal/warmBands : 0.0 )
+        << endl;
+}
+
+// Solved rigid, similarity or affine transform of a band
+static itk::Transform<double, Dimension, Dimension>::Pointer matrixTransform(
+                                        const struct band_transform &transform,
+                                        reg_params params ){
+  if ( params.regmethod == 1 ){
+    return transform.rigid.GetPointer();
+  } else if ( params.regmethod == 2 ){
+    return transform.similarity.GetPointer();
+  }
+  return transform.affine.GetPointer();
+}
+
+// One affine transform doing what the composite does, so that a band
+// is resampled once however long its chain is
+static TransformAffineType::Pointer flattenTransform( CompositeTransformType* const composite ){
+  typedef itk::MatrixOffsetTransformBase<double, Dimension, Dimension> MatrixOffsetTransformType;
+  TransformAffineType::Pointer flat = TransformAffineType::New();
+  flat->SetIdentity();
+  // The last transform added is applied first
+  for (int j=(int)composite->GetNumberOfTransforms() - 1; j >= 0; j--){
+    const MatrixOffsetTransformType *step =
+      dynamic_cast<const MatrixOffsetTransformType*>( composite->GetNthTransform( j ).GetPointer() );
+    flat->Compose( step, false );
+  }
+  return flat;
+}
+
+// Chained registration. Every band is registered against its spectral
+// neighbour nearer the center band, which are all independent. The steps
+// are then composed back to the center band along each chain, flattened,
+// and each band resampled once with its own composed transform
+static void registerChained(  const vector<int> &bands,
+                              ImageType* const fixed,
+                              ImageType* const ffixed,
+                              const function<ImageType::Pointer(ImageType* const, int)> &readBand,
+                              BandWriter &writer,
+                              int firstBand,
+                              struct hyspex_header header,
+                              reg_params params,
+                              BandPool &pool,
+                              BandCache &cache,
+                              vector<double> &seconds ){
+
+  int center = header.bands / 2;
+  vector< vector<int> > chains = spectralChains( bands, header, 1 );
+  vector<int> neighbour( header.bands, center );
+  for (size_t c=0; c < chains.size(); c++){
+    for (size_t n=1; n < chains[c].size(); n++){
+      neighbour[chains[c][n]] = chains[c][n-1];
+    }
+  }
+
+  vector<ImageType::Pointer> fixedw, ffixedw, movingw, neighbourw;
+  for (int w=0; w < pool.size(); w++){
+    fixedw.push_back(  cache.copy( "worker fixed", w, fixed )  );
+    ffixedw.push_back( cache.copy( "worker ffixed", w, ffixed ) );
+    movingw.push_back( cache.container( "moving", w ) );
+    neighbourw.push_back( cache.container( "neighbour", w ) );
+  }
+
+  // Steps between neighbours, in any order
+  vector<struct band_transform> steps( header.bands );
+  vector<double> costs = bandCosts( params, bands, center );
+  pool.run( bands, costs, [&]( int w, int i ){
+    Clock::time_point start = Clock::now();
+    ImageType::Pointer moving  = readBand( movingw[w], i );
+    ImageType::Pointer fmoving = cache.filter( "moving", w, moving, params );
+    if ( neighbour[i] == center ){
+      steps[i] = solveBand( fixedw[w], ffixedw[w], moving, fmoving, params );
+    } else {
+      ImageType::Pointer near  = readBand( neighbourw[w], neighbour[i] );
+      ImageType::Pointer fnear = cache.filter( "neighbour", w, near, params );
+      steps[i] = solveBand( near, fnear, moving, fmoving, params );
+    }
+    seconds[i] = secondsSince( start );
+  });
+
+  // Compose outward, the transform of a band applies its neighbour's first
+  vector<TransformAffineType::Pointer> flat( header.bands );
+  for (size_t c=0; c < chains.size(); c++){
+    CompositeTransformType::Pointer composite;
+    for (size_t n=0; n < chains[c].size(); n++){
+      int i = chains[c][n];
+      CompositeTransformType::Pointer next = CompositeTransformType::New();
+      next->AddTransform( matrixTransform( steps[i], params ) );
+      if ( composite.IsNotNull() ){
+        for (unsigned j=0; j < composite->GetNumberOfTransforms(); j++){
+          next->AddTransform( composite->GetNthTransform( j ) );
+        }
+      }
+      composite = next;
+      flat[i] = flattenTransform( composite );
+    }
+  }
+
+  // Single resample of every band
+  pool.run( bands, costs, [&]( int w, int i ){
+    Clock::time_point start = Clock::now();
+    ImageType::Pointer moving = readBand( movingw[w], i );
+    ResampleFilterType::Pointer resample = resampleAffinePointer( fixedw[w], moving, flat[i] );
+    ImageType::Pointer output = resample->GetOutput();
+    ImageType::Pointer outdiff;
+    diffBand( moving, output, params, outdiff );
+    writer.writeBand( i - firstBand, output->GetBufferPointer(),
+      outdiff.IsNotNull() ? outdiff->GetBufferPointer() : NULL );
+    seconds[i] += secondsSince( start );
+    bandDone( i, header.bands );
+  });
+  pool.printUtilization();
+
+  double total = 0.0;
+  for (size_t n=0; n < bands.size(); n++){
+    total += steps[bands[n]].iterations;
+  }
+  cout  << "Chained registration, average iterations per band: "
+        << ( bands.empty() ? 0.0 : total/bands.size() ) << endl;
+}
+
+// Matrix and offset of a solved rigid, similarity or affine transform,
+// the parameters of the same affine transform about the origin
+static vector<double> affineParameters( const struct band_transform &transform,
+                                        reg_params params ){
+  typedef itk::MatrixOffsetTransformBase<double, Dimension, Dimension> MatrixOffsetTransformType;
+  itk::Transform<double, Dimension, Dimension>::Pointer solved = matrixTransform( transform, params );
+  const MatrixOffsetTransformType *matrix =
+    dynamic_cast<const MatrixOffsetTransformType*>( solved.GetPointer() );
+  vector<double> parameters( 6 );
+  parameters[0] = matrix->GetMatrix()(0, 0);
+  parameters[1] = matrix->GetMatrix()(0, 1);
+  parameters[2] = matrix->GetMatrix()(1, 0);
+  parameters[3] = matrix->GetMatrix()(1, 1);
+  parameters[4] = matrix->GetOffset()[0];
+  parameters[5] = matrix->GetOffset()[1];
+  return parameters;
+}
+
+static TransformAffineType::Pointer affineTransform( const vector<double> &parameters ){
+  TransformAffineType::Pointer affine = TransformAffineType::New();
+  TransformAffineType::MatrixType matrix;
+  matrix(0, 0) = parameters[0];
+  matrix(0, 1) = parameters[1];
+  matrix(1, 0) = parameters[2];
+  matrix(1, 1) = parameters[3];
+  TransformAffineType::OutputVectorType offset;
+  offset[0] = parameters[4];
+  offset[1] = parameters[5];
+  affine->SetMatrix( matrix );
+  affine->SetOffset( offset );
+  return affine;
+}
+
+// Least squares polynomial of the given degree through (x, y), with the
+// terms of order below lowest held at zero. Coefficients, lowest order first
+static vector<double> fitPolynomial( const vector<double> &x,
+                                     const vector<double> &y,
+                                     int degree,
+                                     int lowest = 0 ){
+  int terms = max( 0, degree + 1 - lowest );
+  // Normal equations, solved by elimination with partial pivoting
+  vector< vector<double> > a( terms, vector<double>( terms + 1, 0.0 ) );
+  for (size_t n=0; n < x.size(); n++){
+    vector<double> power( 2*( lowest + terms ), 1.0 );
+    for (size_t k=1; k < power.size(); k++){
+      power[k] = power[k-1]*x[n];
+    }
+    for (int r=0; r < terms; r++){
+      for (int c=0; c < terms; c++){
+        a[r][c] += power[2*lowest + r + c];
+      }
+      a[r][terms] += power[lowest + r]*y[n];
+    }
+  }
+  for (int c=0; c < terms; c++){
+    int pivot = c;
+    for (int r=c+1; r < terms; r++){
+      if ( fabs( a[r][c] ) > fabs( a[pivot][c] ) ){
+        pivot = r;
+      }
+    }
+    swap( a[c], a[pivot] );
+    for (int r=c+1; r < terms; r++){
+      double factor = a[c][c] != 0.0 ? a[r][c]/a[c][c] : 0.0;
+      for (int k=c; k <= terms; k++){
+        a[r][k] -= factor*a[c][k];
+      }
+    }
+  }
+  vector<double> coefficients( max( degree + 1, lowest ), 0.0 );
+  for (int r=terms-1; r >= 0; r--){
+    double sum = a[r][terms];
+    for (int k=r+1; k < terms; k++){
+      sum -= a[r][k]*coefficients[lowest + k];
+    }
+    coefficients[lowest + r] = a[r][r] != 0.0 ? sum/a[r][r] : 0.0;
+  }
+  return coefficients;
+}
+
+static double evalPolynomial( const vector<double> &coefficients, double x ){
+  double value = 0.0;
+  for (int k=(int)coefficients.size() - 1; k >= 0; k--){
+    value = value*x + coefficients[k];
+  }
+  return value;
+}
+
+// Normalized cross correlation of two bands of the same size
+static double correlation( ImageType* const a, ImageType* const b ){
+  size_t pixels = a->GetLargestPossibleRegion().GetNumberOfPixels();
+  const float *pa = a->GetBufferPointer();
+  const float *pb = b->GetBufferPointer();
+  double ma = 0.0, mb = 0.0;
+  for (size_t n=0; n < pixels; n++){
+    ma += pa[n];
+    mb += pb[n];
+  }
+  ma /= pixels;
+  mb /= pixels;
+  double ab = 0.0, aa = 0.0, bb = 0.0;
+  for (size_t n=0; n < pixels; n++){
+    ab += ( pa[n] - ma )*( pb[n] - mb );
+    aa += ( pa[n] - ma )*( pa[n] - ma );
+    bb += ( pb[n] - mb )*( pb[n] - mb );
+  }
+  return aa > 0.0 && bb > 0.0 ? ab/sqrt( aa*bb ) : 0.0;
+}
+
+// Anchor bands. Every anchor_step-th band by wavelength, counted outward
+// from the center band, and the outermost bands are registered in full.
+// A polynomial in wavelength is fitted to each affine parameter of the
+// anchors, and the other bands are resampled with the fitted transforms.
+// A band whose filtered correlation with the fixed band falls more than
+// anchor_tolerance below that of its nearest anchors is registered in full
+static void registerAnchored( const vector<int> &bands,
+                              ImageType* const fixed,
+                              ImageType* const ffixed,
+                              const function<ImageType::Pointer(ImageType* const, int)> &readBand,
+                              BandWriter &writer,
+                              int firstBand,
+                              struct hyspex_header header,
+                              reg_params params,
+                              BandPool &pool,
+                              BandCache &cache,
+                              vector<double> &seconds ){
+
+  int center = header.bands / 2;
+  bool wavelengths = (int)header.wlens.size() == header.bands;
+  auto wavelength = [&]( int i ){
+    return wavelengths ? (double)header.wlens[i] : (double)i;
+  };
+
+  vector<char> anchor( header.bands, 0 );
+  vector< vector<int> > chains = spectralChains( bands, header, 1 );
+  for (size_t c=0; c < chains.size(); c++){
+    for (size_t n=0; n < chains[c].size(); n++){
+      if ( ( n + 1 ) % params.anchor_step == 0 || n + 1 == chains[c].size() ){
+        anchor[chains[c][n]] = 1;
+      }
+    }
+  }
+  vector<int> anchors, others;
+  for (size_t n=0; n < bands.size(); n++){
+    ( anchor[bands[n]] ? anchors : others ).push_back( bands[n] );
+  }
+
+  vector<ImageType::Pointer> fixedw, ffixedw, movingw;
+  for (int w=0; w < pool.size(); w++){
+    fixedw.push_back(  cache.copy( "worker fixed", w, fixed )  );
+    ffixedw.push_back( cache.copy( "worker ffixed", w, ffixed ) );
+    movingw.push_back( cache.container( "moving", w ) );
+  }
 
+  // Full registration, also used for the bands failing the residual check
+  auto registerFull = [&]( int w, int i, ImageType* const moving, ImageType* const fmoving )
+      -> struct band_transform {
+    ImageType::Pointer output;
+    ImageType::Pointer outdiff;
+    struct band_transform transform = solveBand( fixedw[w], ffixedw[w], moving, fmoving, params );
+    resampleBand( fixedw[w], moving, transform, params, output );
+    diffBand( moving, output, params, outdiff );
+    writer.writeBand( i - firstBand, output->GetBufferPointer(),
+      outdiff.IsNotNull() ? outdiff->GetBufferPointer() : NULL );
+    return transform;
+  };
+
+  vector< vector<double> > solved( header.bands );
+  vector<double> score( header.bands, 0.0 );
+  pool.run( anchors, bandCosts( params, anchors, center ), [&]( int w, int i ){
+    Clock::time_point start = Clock::now();
+    ImageType::Pointer moving  = readBand( movingw[w], i );
+    ImageType::Pointer fmoving = cache.filter( "moving", w, moving, params );
+    solved[i] = affineParameters( registerFull( w, i, moving, fmoving ), params );
+    ImageType::Pointer check = resampleAffinePointer( ffixedw[w], fmoving,
+      affineTransform( solved[i] ) )->GetOutput();
+    score[i] = correlation( ffixedw[w], check );
+    seconds[i] = secondsSince( start );
+    bandDone( i, header.bands );
+  });
+
+  // Fit the change of every parameter from the identity against wavelength,
+  // without a constant term, so the fitted transform of the center band is
+  // exactly the identity
+  double span = 0.0;
+  for (size_t n=0; n < anchors.size(); n++){
+    span = max( span, fabs( wavelength( anchors[n] ) - wavelength( center ) ) );
   }
+  if ( span == 0.0 ){
+    span = 1.0;
+  }
+  vector<double> x;
+  vector< vector<double> > y( 6 );
+  double identity[6] = { 1.0, 0.0, 0.0, 1.0, 0.0, 0.0 };
+  for (size_t n=0; n < anchors.size(); n++){
+    x.push_back( ( wavelength( anchors[n] ) - wavelength( center ) )/span );
+    for (int k=0; k < 6; k++){
+      y[k].push_back( solved[anchors[n]][k] - identity[k] );
+    }
+  }
+  int degree = max( 0, min( params.anchor_degree, (int)x.size() ) );
+  vector< vector<double> > fit( 6 );
+  for (int k=0; k < 6; k++){
+    fit[k] = fitPolynomial( x, y[k], degree, 1 );
+    fit[k][0] += identity[k];
+  }
+
+  // Correlation expected of a band, the lower of its nearest anchors on each side
+  auto expected = [&]( int i ) -> double {
+    double below = -1.0, above = -1.0, dbelow = 0.0, dabove = 0.0;
+    for (size_t n=0; n < anchors.size(); n++){
+      double d = wavelength( anchors[n] ) - wavelength( i );
+      if ( d <= 0.0 && ( below < 0.0 || -d < dbelow ) ){
+        below = score[anchors[n]];
+        dbelow = -d;
+      }
+      if ( d >= 0.0 && ( above < 0.0 || d < dabove ) ){
+        above = score[anchors[n]];
+        dabove = d;
+      }
+    }
+    if ( below < 0.0 ) return above;
+    if ( above < 0.0 ) return below;
+    return min( below, above );
+  };
+
+  vector<char> fallback( header.bands, 0 );
+  pool.run( others, bandCosts( params, others, center ), [&]( int w, int i ){
+    Clock::time_point start = Clock::now();
+    ImageType::Pointer moving  = readBand( movingw[w], i );
+    ImageType::Pointer fmoving = cache.filter( "moving", w, moving, params );
+
+    vector<double> parameters( 6 );
+    double xi = ( wavelength( i ) - wavelength( center ) )/span;
+    for (int k=0; k < 6; k++){
+      parameters[k] = evalPolynomial( fit[k], xi );
+    }
+    TransformAffineType::Pointer affine = affineTransform( parameters );
+    ImageType::Pointer check = resampleAffinePointer( ffixedw[w], fmoving, affine )->GetOutput();
+
+    if ( correlation( ffixedw[w], check ) < expected( i ) - params.anchor_tolerance ){
+      fallback[i] = 1;
+      registerFull( w, i, moving, fmoving );
+    } else {
+      ImageType::Pointer output = resampleAffinePointer( fixedw[w], moving, affine )->GetOutput();
+      ImageType::Pointer outdiff;
+      diffBand( moving, output, params, outdiff );
+      writer.writeBand( i - firstBand, output->GetBufferPointer(),
+        outdiff.IsNotNull() ? outdiff->GetBufferPointer() : NULL );
+    }
+    seconds[i] = secondsSince( start );
+    bandDone( i, header.bands );
+  });
+  pool.printUtilization();
+
+  int fallbacks = 0;
+  for (size_t n=0; n < others.size(); n++){
+    if ( fallback[others[n]] ){
+      cout << "Band " << others[n] << " registered in full, fit below tolerance" << endl;
+      fallbacks++;
+    }
+  }
+  cout  << "Anchor bands: " << anchors.size()
+        << ", fitted: " << others.size() - fallbacks
+        << ", registered in full after the residual check: " << fallbacks
+        << endl;
+}
 
-  // Write to .img container
-  // See readimage.h
-  hyperspectral_write_header( params.reg_name.c_str(), header.bands,
-    header.samples, header.lines, header.wlens );
-  hyperspectral_write_image( params.reg_name.c_str(), header.bands,
-    header.samples, header.lines, out );
+// Register bands against the fixed band and hand them to the writer,
+// on the band worker pool or, with pipeline = 1, on the stage pipeline.
+// With prefilter = 1 the bands are filtered in chunks up front, and with
+// spectral_walk = 1 they are registered outward from the center band.
+// chained = 1 registers every band against its neighbour instead, and
+// anchor_step > 1 registers only some bands, fitting the others
+void registerBands( const vector<int> &bands,
+                    ImageType* const fixed,
+                    ImageType* const ffixed,
+                    const function<ImageType::Pointer(ImageType* const, int)> &readBand,
+                    BandWriter &writer,
+                    int firstBand,
+                    struct hyspex_header header,
+                    reg_params params,
+                    BandPool &pool,
+                    BandCache &cache ){
+
+  vector<double> seconds( header.bands, 0.0 );
+  if ( params.anchor_step > 1 && params.regmethod >= 1 && params.regmethod <= 3 ){
+    registerAnchored( bands, fixed, ffixed, readBand, writer, firstBand, header, params, pool, cache, seconds );
+    writeCostHistory( params, seconds );
+    return;
+  }
+  if ( params.chained == 1 && params.regmethod >= 1 && params.regmethod <= 3 ){
+    registerChained( bands, fixed, ffixed, readBand, writer, firstBand, header, params, pool, cache, seconds );
+    writeCostHistory( params, seconds );
+    return;
+  }
+  if ( params.spectral_walk == 1 && params.regmethod >= 1 && params.regmethod <= 3 ){
+    registerWalk( bands, fixed, ffixed, readBand, writer, firstBand, header, params, pool, cache, seconds );
+    writeCostHistory( params, seconds );
+    return;
+  }
+  if ( params.prefilter != 1 || ( params.median != 1 && params.gradient != 1 ) || bands.empty() ){
+    registerChunk( bands, fixed, ffixed, readBand, NULL, writer, firstBand, header, params, pool, cache, seconds );
+    writeCostHistory( params, seconds );
+    return;
+  }
 
-  if ( params.diff_conf == 1 && params.regmethod != 6){
-    hyperspectral_write_header( params.diff_name.c_str(), header.bands,
-      header.samples, header.lines, header.wlens );
-    hyperspectral_write_image( params.diff_name.c_str(), header.bands,
-      header.samples, header.lines, diff );
+  // The whole shard at once, unless streaming or limited by prefilter_chunk
+  size_t chunk = bands.size();
+  if ( params.prefilter_chunk > 0 ){
+    chunk = min( chunk, (size_t)params.prefilter_chunk );
+  } else if ( params.streaming == 1 ){
+    chunk = min( chunk, (size_t)( 4*pool.size() ) );
   }
+  BandStore store( header.samples, header.lines, chunk );
+  for (size_t first=0; first < bands.size(); first += chunk){
+    vector<int> part( bands.begin() + first,
+                      bands.begin() + min( first + chunk, bands.size() ) );
+    Clock::time_point start = Clock::now();
+    store.fill( part, readBand, params, pool );
+    cout << "Prefiltered " << part.size() << " bands in " << secondsSince( start ) << " s" << endl;
+    registerChunk( part, fixed, ffixed, readBand, &store, writer, firstBand, header, params, pool, cache, seconds );
+  }
+  writeCostHistory( params, seconds );
+}
 
-  // Clear memory
-  delete [] out;
-  delete [] diff;
-  delete [] img;
+// Name of the diff output, or NULL if no diff is written
+const char* diffOutputName( const reg_params &params ){
+  if ( params.diff_conf == 1 && params.regmethod != 6 ){
+    return params.diff_name.c_str();
+  }
+  return NULL;
+}
 
+// Datatype of the output, the input datatype unless set in params
+int outputDatatype( const reg_params &params, struct hyspex_header header ){
+  if ( params.datatype == 0 ){
+    return header.datatype;
+  }
+  return params.datatype;
+}
+
+// Progress line, safe to call from band workers
+void bandDone( int i, int bands ){
+  static mutex logMutex;
+  lock_guard<mutex> lock( logMutex );
+  cout << "Done with " << i + 1 << " of " << bands << endl;
+}
+
+// Seconds elapsed since start
+double secondsSince( Clock::time_point start ){
+  return chrono::duration<double>( Clock::now() - start ).count();
+}
+
+// Estimated cost of registering each band, used to start the expensive
+// bands first. Bands far from the fixed band take longer to converge, and
+// B-spline and demons are far slower than the linear transforms. Timings
+// from an earlier run with the same method replace the estimate.
+vector<double> bandCosts( const reg_params &params,
+                          const vector<int> &bands,
+                          int center ){
+  // Relative cost of regmethod 1-6, index 0 unused
+  const double methodCost[7] = { 1.0, 1.0, 1.2, 1.5, 50.0, 0.5, 50.0 };
+  double method = 1.0;
+  if ( params.regmethod >= 1 && params.regmethod <= 6 ){
+    method = methodCost[params.regmethod];
+  }
+
+  map<int, double> history = readCostHistory( params );
+  vector<double> costs( bands.size() );
+  for (size_t n=0; n < bands.size(); n++){
+    int i = bands[n];
+    if ( i == center ){
+      costs[n] = 0.0;
+    } else if ( history.count( i ) ){
+      costs[n] = history[i];
+    } else {
+      costs[n] = method*( 1.0 + 2.0*abs( i - center )/( center + 1.0 ) );
+    }
+  }
+  return costs;
+}
+
+// Per-band seconds of the last run with the same regmethod, empty if
+// there is none or the cost history is disabled
+map<int, double> readCostHistory( const reg_params &params ){
+  map<int, double> history;
+  if ( params.cost_history != 1 ){
+    return history;
+  }
+  ifstream fid( ( shardName( params.reg_name, params ) + ".cost" ).c_str() );
+  string key;
+  int regmethod;
+  if ( !( fid >> key >> regmethod ) || key != "regmethod" || regmethod != params.regmethod ){
+    return history;
+  }
+  int i;
+  double seconds;
+  while ( fid >> i >> seconds ){
+    history[i] = seconds;
+  }
+  cout << "Band costs from " << shardName( params.reg_name, params ) << ".cost" << endl;
+  return history;
+}
+
+// Store per-band seconds for scheduling the next run, bands that were
+// not registered are left out
+void writeCostHistory( const reg_params &params,
+                       const vector<double> &seconds ){
+  if ( params.cost_history != 1 ){
+    return;
+  }
+  ofstream fid( ( shardName( params.reg_name, params ) + ".cost" ).c_str() );
+  fid << "regmethod " << params.regmethod << endl;
+  for (size_t i=0; i < seconds.size(); i++){
+    if ( seconds[i] > 0.0 ){
+      fid << i << " " << seconds[i] << endl;
+    }
+  }
+}
+
+// Median and/or gradient filtering before registration
+ImageType::Pointer filterBand(  ImageType* const band,
+                                reg_params params,
+                                int threads ){
+  ImageType::Pointer filtered = band;
+  if ( params.median == 1){
+    filtered = medianFilter( filtered, params.radius, threads );
+    filtered->Update();
+  }
+  if ( params.gradient == 1){
+    filtered = gradientFilter( filtered, params.sigma, threads );
+    filtered->Update();
+  }
+  return filtered;
+}
+
+// Registration of a single band with the chosen method
+void registerBand(  ImageType* const fixed,
+                    ImageType* const ffixed,
+                    ImageType* const moving,
+                    ImageType* const fmoving,
+                    reg_params params,
+                    ImageType::Pointer &output,
+                    ImageType::Pointer &outdiff ){
+  struct band_transform transform = solveBand( fixed, ffixed, moving, fmoving, params );
+  resampleBand( fixed, moving, transform, params, output );
+  diffBand( moving, output, params, outdiff );
+}
+
+// Find the transform of a band, the expensive part of registerBand
+struct band_transform solveBand(  ImageType* const fixed,
+                                  ImageType* const ffixed,
+                                  ImageType* const moving,
+                                  ImageType* const fmoving,
+                                  reg_params params,
+                                  const struct band_transform *initial ){
+  struct band_transform transform;
+  transform.iterations = 0;
+
+  // Throw to registration handler
+  // Rigid transform
+  if (params.regmethod == 1){
+    transform.rigid = registration1(
+                                ffixed,
+                                fmoving,
+                                params,
+                                initial ? initial->rigid.GetPointer() : NULL,
+                                &transform.iterations );
+    // Similarity transform
+  } else if (params.regmethod == 2){
+    transform.similarity = registration2(
+                                ffixed,
+                                fmoving,
+                                params,
+                                initial ? initial->similarity.GetPointer() : NULL,
+                                &transform.iterations );
+    // Affine transform
+  } else if (params.regmethod == 3){
+    transform.affine = registration3(
+                                ffixed,
+                                fmoving,
+                                params,
+                                initial ? initial->affine.GetPointer() : NULL,
+                                &transform.iterations );
+    // BSpline transform
+  } else if (params.regmethod == 4){
+    transform.bspline = registration4(
+                                ffixed,
+                                fmoving,
+                                params,
+                                &transform.translation );
+  } else if (params.regmethod == 5){
+    transform.translation = translation(
+                                ffixed,
+                                fmoving,
+                                params );
+  } else if (params.regmethod == 6){
+    transform.warper = registration5(
+                                fixed,
+                                moving,
+                                params );
+  }
+  return transform;
+}
+
+// Resample the moving band onto the fixed band with its transform
+void resampleBand(  ImageType* const fixed,
+                    ImageType* const moving,
+                    const struct band_transform &transform,
+                    reg_params params,
+                    ImageType::Pointer &output,
+                    int threads ){
+
+  // Resample image
+  ResampleFilterType::Pointer       registration;
+
+  if (params.regmethod == 1){
+    registration = resampleRigidPointer(
+                                fixed,
+                                moving,
+                                transform.rigid );
+  } else if (params.regmethod == 2){
+    registration = resampleSimilarityPointer(
+                                fixed,
+                                moving,
+                                transform.similarity );
+  } else if (params.regmethod == 3){
+    registration = resampleAffinePointer(
+                                fixed,
+                                moving,
+                                transform.affine );
+  } else if (params.regmethod == 4 && transform.translation.IsNotNull()){
+    // The initial translation applies after the B-spline
+    CompositeTransformType::Pointer composite = CompositeTransformType::New();
+    composite->AddTransform( transform.translation );
+    composite->AddTransform( transform.bspline );
+    ResampleFilterType::Pointer resample = ResampleFilterType::New();
+    resample->SetTransform(                composite                );
+    resample->SetInput(                     moving                  );
+    resample->SetSize(  fixed->GetLargestPossibleRegion().GetSize() );
+    resample->SetOutputOrigin(         fixed->GetOrigin()           );
+    resample->SetOutputSpacing(        fixed->GetSpacing()          );
+    resample->SetDefaultPixelValue(               0.0               );
+    registration = resample;
+  } else if (params.regmethod == 4){
+    registration = resampleBSplinePointer(
+                                fixed,
+                                moving,
+                                transform.bspline );
+  } else if (params.regmethod == 5){
+    ResampleFilterType::Pointer resample = ResampleFilterType::New();
+    resample->SetTransform(          transform.translation          );
+    resample->SetInput(                     moving                  );
+    resample->SetSize(  fixed->GetLargestPossibleRegion().GetSize() );
+    resample->SetOutputOrigin(         fixed->GetOrigin()           );
+    resample->SetOutputSpacing(        fixed->GetSpacing()          );
+    resample->SetDefaultPixelValue(               0.0               );
+    registration = resample;
+  }
+
+  // Add to output containers
+  if (params.regmethod == 6){
+    setFilterThreads( transform.warper, threads );
+    output = transform.warper->GetOutput();
+    output->Update();
+  } else {
+    setFilterThreads( registration, threads );
+    output = registration->GetOutput();
+    output->Update();
+  }
+}
+
+// Difference between the moving band and the registered band,
+// not set for demons
+void diffBand(  ImageType* const moving,
+                ImageType* const output,
+                reg_params params,
+                ImageType::Pointer &outdiff,
+                int threads ){
+  if (params.regmethod == 6){
+    return;
+  }
+  DifferenceFilterType::Pointer difference = DifferenceFilterType::New();
+  difference->SetInput1(        moving         );
+  difference->SetInput2(        output         );
+  // moving may be a band of the read-only mapping
+  difference->InPlaceOff();
+  setFilterThreads( difference, threads );
+  outdiff = difference->GetOutput();
+  outdiff->Update();
 }
 
 void hyperspec_mat(const char *filename){
@@ -230,32 +1263,57 @@ void hyperspec_mat(const char *filename){
   struct reg_params params;
   conf_err_t reg_errcode = params_read( &params );
 
+  BandPool pool( params.workers );
+  BandCache cache;
+  hyperspec_mat( filename, params, pool, cache );
+}
+
+void hyperspec_mat( const char *filename,
+                    reg_params params,
+                    BandPool &pool,
+                    BandCache &cache ){
+
   // Function for handling .mat
   // Read mat pointer
   mat_t *matfp;
 
   matfp = Mat_Open(filename,MAT_ACC_RDONLY);
   if ( NULL == matfp ) {
-    fprintf(stderr,"Error opening MAT file %s\n",filename);
-    exit(1);
+    throw runtime_error( string( "could not open MAT file " ) + filename );
   }
 
   // Read mat information
+  // The image cube itself is read band by band further down
   matvar_t *HSIi = Mat_VarReadInfo(matfp, "HSI");
-  matvar_t *HSId = Mat_VarRead(matfp, "HSI");
-  matvar_t *wavelengthsi = Mat_VarReadInfo(matfp, "wavelengths");
   matvar_t *wavelengthsd = Mat_VarRead(matfp, "wavelengths");
 
+  // Freed and closed on return, also when a band fails
+  ScopeRelease release( [&](){
+    if ( wavelengthsd != NULL ){
+      Mat_VarFree(wavelengthsd);
+    }
+    if ( HSIi != NULL ){
+      Mat_VarFree(HSIi);
+    }
+    Mat_Close(matfp);
+  });
+  if ( NULL == HSIi || NULL == wavelengthsd || HSIi->rank != 3 ){
+    throw runtime_error( string( "missing HSI or wavelengths in " ) + filename );
+  }
+  if ( !MatBandReader::supported( HSIi ) ){
+    throw runtime_error( "unsupported class " + to_string( HSIi->class_type )
+                         + " of HSI in " + filename );
+  }
+
   // Get information from file
   // Image size
-  unsigned xSize = HSId->dims[0];
-  unsigned ySize = HSId->dims[1];
+  unsigned xSize = HSIi->dims[0];
+  unsigned ySize = HSIi->dims[1];
   // Number of images
-  unsigned nSize = HSId->dims[2];
+  unsigned nSize = HSIi->dims[2];
   //Wavelengths
   unsigned nWave = wavelengthsd->dims[1];
   float *wData = static_cast<float*>(wavelengthsd->data);
-  float *hData = static_cast<float*>(HSId->data);
   cout  << "Number of images: "
         << nSize
         << ", Image dimensions: "
@@ -274,196 +1332,131 @@ void hyperspec_mat(const char *filename){
         << " Compression, wavelengths: "
         << wavelengthsd->compression
         << " Array size: "
-        << HSId->nbytes/HSId->data_size
+        << (size_t)xSize*ySize*nSize
         << " Rank, images: "
-        << HSId->rank
+        << HSIi->rank
         << " Compression, images: "
-        << HSId->compression
-        << " Data type, images: "
-        << HSId->data_type
+        << HSIi->compression
+        << " Class type, images: "
+        << HSIi->class_type
         << endl;
 
 
-  // Declare ITK pointers
-  ImageType::Pointer fixed    = imageMatContainer( xSize, ySize );
-  ImageType::Pointer ffixed   = imageMatContainer( xSize, ySize );
-  ImageType::Pointer moving   = imageMatContainer( xSize, ySize );
-  ImageType::Pointer fmoving  = imageMatContainer( xSize, ySize );
-  ImageType::Pointer output   = imageMatContainer( xSize, ySize );
-  ImageType::Pointer outdiff  = imageMatContainer( xSize, ySize );
-  // Difference image
-  DifferenceFilterType::Pointer difference = DifferenceFilterType::New();
-  // Resample image
-  ResampleFilterType::Pointer       registration;
-
-  // Read fixed
-  fixed = readMat(fixed, nSize/2, xSize, ySize, hData);
+  // Declare ITK pointers, bands are the transpose of the .mat bands
+  cache.reshape( ySize, xSize );
+  ImageType::Pointer fixed    = cache.container( "fixed", 0 );
+  ImageType::Pointer ffixed;
 
-  // Filter image
-  ffixed = fixed;
-  if (params.median == 1){
-    ffixed = medianFilter( ffixed, params.radius );
-    ffixed->Update();
+  // Bands are read on a background thread, fixed band first and then
+  // most expensive first, a band ahead of every worker. Workers take
+  // bands from the reader as they become idle
+  vector<int> bands;
+  for (int i=0; i<nSize; i++){
+    bands.push_back( i );
   }
-  if (params.gradient == 1){
-    ffixed = gradientFilter( ffixed, params.sigma );
-    ffixed->Update();
+  vector<double> costs = bandCosts( params, bands, nSize/2 );
+  costs[nSize-1] = 0.0;
+  vector<int> order( bands );
+  stable_sort( order.begin(), order.end(),
+    [&]( int a, int b ){ return costs[a] > costs[b]; } );
+  order.insert( order.begin(), nSize/2 );
+  vector<double> seconds( nSize, 0.0 );
+
+  // Output containers on disk, every band is written as soon as it is
+  // done, so neither cube is held in memory
+  size_t dims[3] = { HSIi->dims[0], HSIi->dims[1], HSIi->dims[2] };
+  MatBandWriter out( params.reg_name, wavelengthsd, dims );
+  unique_ptr<MatBandWriter> diff;
+  if ( params.diff_conf == 1 ){
+    diff.reset( new MatBandWriter( params.diff_name, wavelengthsd, dims ) );
   }
 
-
-  WarperType::Pointer warper = WarperType::New();
-  float *out  = new float[xSize*ySize*nSize]();
-  float *diff = new float[xSize*ySize*nSize]();
-  for (int i=0; i<nSize; i++){
-
-    // Read moving
-    moving = readMat( moving, i, xSize, ySize, hData );
-
-    // Skip center band (fixed) and reference
-    if ( i == nSize/2 || i == nSize-1){
-      out = writeMat( moving, out, i, xSize, ySize );
-      continue;
-    }
-
-    // Filter images
-    fmoving = moving;
-    if ( params.median == 1){
-      fmoving = medianFilter( fmoving, params.radius );
-      fmoving->Update();
-    }
-    if ( params.gradient == 1){
-      fmoving = gradientFilter( fmoving, params.sigma );
-      fmoving->Update();
-    }
-
-    // Throw to registration handler
-    // Rigid transform
-    if (params.regmethod == 1){
-      TransformRigidType::Pointer       rigid_transform;
-      rigid_transform = registration1(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleRigidPointer(
-                                  fixed,
-                                  moving,
-                                  rigid_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-      // Similarity transform
-    } else if (params.regmethod == 2){
-      TransformSimilarityType::Pointer  similarity_transform;
-      similarity_transform = registration2(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleSimilarityPointer(
-                                  fixed,
-                                  moving,
-                                  similarity_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-      // Affine transform
-    } else if (params.regmethod == 3){
-      TransformAffineType::Pointer      affine_transform;
-      affine_transform = registration3(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleAffinePointer(
-                                  fixed,
-                                  moving,
-                                  affine_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-      // BSpline transform
-    } else if (params.regmethod == 4){
-      TransformBSplineType::Pointer      bspline_transform;
-      bspline_transform = registration4(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleBSplinePointer(
-                                  fixed,
-                                  moving,
-                                  bspline_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-    } else if (params.regmethod == 5){
-      CompositeTransformType::Pointer translation_transform;
-      translation_transform = translation(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-
-      ResampleFilterType::Pointer resample = ResampleFilterType::New();
-      resample->SetTransform(          translation_transform          );
-      resample->SetInput(                     moving                  );
-      resample->SetSize(  fixed->GetLargestPossibleRegion().GetSize() );
-      resample->SetOutputOrigin(         fixed->GetOrigin()           );
-      resample->SetOutputSpacing(        fixed->GetSpacing()          );
-      resample->SetDefaultPixelValue(               0.0               );
-      registration = resample;
-
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-    } else if (params.regmethod == 6){
-      warper = registration5(
-                                  fixed,
-                                  moving,
-                                  params );
-    }
-
-    // Add to output containers
-    if (params.regmethod == 6){
-      output = warper->GetOutput();
-      output->Update();
-    } else {
-      output = registration->GetOutput();
-      output->Update();
-
-      outdiff = difference->GetOutput();
-      outdiff->Update();
+  // The reader uses matfp on its own thread, and is joined at the end
+  // of this block, before matfp is closed
+  {
+    MatBandReader reader( matfp, HSIi, order, pool.size() + 1 );
+    vector<float> band;
+    int i;
+
+    // Read fixed
+    reader.nextBand( i, band );
+    fixed = readMat(fixed, 0, xSize, ySize, &band[0]);
+
+    // Filter image
+    ffixed = filterBand( fixed, params );
+
+    // Every worker has its own fixed images, moving container and
+    // column-major band to write from
+    vector<ImageType::Pointer> fixedw, ffixedw, movingw;
+    vector< vector<float> > bandw( pool.size(), vector<float>( (size_t)xSize*ySize ) );
+    for (int w=0; w < pool.size(); w++){
+      fixedw.push_back(  cache.copy( "worker fixed", w, fixed )  );
+      ffixedw.push_back( cache.copy( "worker ffixed", w, ffixed ) );
+      movingw.push_back( cache.container( "moving", w ) );
     }
 
-    /* Uncomment for writing to .tif
-    WriterType::Pointer writer = WriterType::New();
-    string name = params.reg_name;
-    name += to_string(i);
-    name += ".tif";
-    writer->SetFileName( name );
-    writer->SetInput( output );
-    //writer->SetInput( moving );
-    writer->Update();
-    */
-
-    // Update output array(s)
-    out = writeMat( output, out, i, xSize, ySize );
-    if ( params.diff_conf == 1 && params.regmethod != 6){
-      diff = writeMat( output, diff, i, xSize, ySize );
+    // Each task takes the next band from the reader
+    vector<int> tasks;
+    for (int n=0; n<nSize; n++){
+      tasks.push_back( n );
     }
 
-    cout << "Done with " << i + 1 << " of " << nSize << endl;
-
-  }
-
-  // Write to .mat container
-  outMat( out, params.reg_name, wavelengthsd, HSId );
-  if (params.diff_conf == 1 ){
-    outMat( diff, params.diff_name, wavelengthsd, HSId );
+    pool.run( tasks, [&]( int w, int n ){
+
+      Clock::time_point start = Clock::now();
+      int i;
+      vector<float> band;
+      reader.nextBand( i, band );
+
+      ImageType::Pointer moving;
+      ImageType::Pointer fmoving;
+      ImageType::Pointer output;
+      ImageType::Pointer outdiff;
+
+      // Read moving
+      moving = readMat( movingw[w], 0, xSize, ySize, &band[0] );
+
+      // Skip center band (fixed) and reference
+      if ( i == nSize/2 || i == nSize-1){
+        writeMat( moving, &bandw[w][0], 0, xSize, ySize );
+        out.writeBand( i, &bandw[w][0] );
+        return;
+      }
+
+      // Filter images
+      fmoving = cache.filter( "moving", w, moving, params );
+
+      // Throw to registration handler
+      registerBand( fixedw[w], ffixedw[w], moving, fmoving, params, output, outdiff );
+
+      /* Uncomment for writing to .tif
+      WriterType::Pointer writer = WriterType::New();
+      string name = params.reg_name;
+      name += to_string(i);
+      name += ".tif";
+      writer->SetFileName( name );
+      writer->SetInput( output );
+      //writer->SetInput( moving );
+      writer->Update();
+      */
+
+      // Write output band(s) to their place in the files
+      writeMat( output, &bandw[w][0], 0, xSize, ySize );
+      out.writeBand( i, &bandw[w][0] );
+      if ( diff && params.regmethod != 6){
+        writeMat( outdiff, &bandw[w][0], 0, xSize, ySize );
+        diff->writeBand( i, &bandw[w][0] );
+      }
+
+      seconds[i] = secondsSince( start );
+      bandDone( i, nSize );
+    });
+    pool.printUtilization();
   }
+  writeCostHistory( params, seconds );
 
   // Cleanup
-  Mat_VarFree(wavelengthsi);
-  Mat_VarFree(wavelengthsd);
-  Mat_VarFree(HSIi);
-  Mat_VarFree(HSId);
-  Mat_Close(matfp);
+  out.close();
 }
 
 // Initiate image container
@@ -488,20 +1481,33 @@ ImageType::Pointer imageContainer( struct hyspex_header header ){
 }
 
 // Reading to image container
+// Band i is a strided run of lines in the BIL ordered array
 ImageType::Pointer readITK( ImageType* const itkimg,
                             float *img,
                             int i,
                             struct hyspex_header header ){
 
-  for (int j=0; j < header.lines; j++){
-    for (int k=0; k < header.samples; k++){
-      ImageType::IndexType pixelIndex;
-      pixelIndex[0] = k;
-      pixelIndex[1] = j;
-      itkimg->SetPixel(pixelIndex, img[j*header.samples*header.bands
-        + i*header.samples + k]);
-    }
+  copyStrided( img + i*header.samples, header.samples*header.bands, 1,
+               itkimg->GetBufferPointer(), header.samples, 1,
+               header.lines, header.samples );
+  itkimg->Modified();
+  return itkimg;
+}
+
+// Reading to image container from memory-mapped image
+// Contiguous float bands (BSQ) are wrapped in place and itkimg is
+// ignored, other bands are converted straight into its buffer
+ImageType::Pointer readITK( ImageType* const itkimg,
+                            struct hyperspectral_mmap *image,
+                            int i ){
+
+  struct hyperspectral_band_view view = hyperspectral_mmap_band(image, i);
+  float *slice = hyperspectral_band_slice(view);
+  if ( slice != NULL ){
+    return wrapBand( slice, view.samples, view.lines );
   }
+  hyperspectral_band_to_float(view, itkimg->GetBufferPointer(), view.samples);
+  itkimg->Modified();
   return itkimg;
 }
 
@@ -511,28 +1517,78 @@ float* writeITK(            ImageType* const itkimg,
                             int i,
                             struct hyspex_header header ){
 
-  for (int j=0; j < header.lines; j++){
-    for (int k=0; k < header.samples; k++){
-      ImageType::IndexType pixelIndex;
-      pixelIndex[0] = k;
-      pixelIndex[1] = j;
-      image[j*header.samples*header.bands + i*header.samples + k]
-        = itkimg->GetPixel(pixelIndex);
-    }
-  }
+  copyStrided( itkimg->GetBufferPointer(), header.samples, 1,
+               image + i*header.samples, header.samples*header.bands, 1,
+               header.lines, header.samples );
   return image;
 }
 
 const int MAX_CHAR = 512;
-const int MAX_FILE_SIZE = 4000;
+const int MAX_FILE_SIZE = 16000;
+
+// Variables read by params_read
+static const char *knownParams[] = {
+  "regmethod", "reg_name", "diff_conf", "diff_name", "median", "radius",
+  "gradient", "sigma", "angle", "scale", "lrate", "slength", "niter",
+  "numoflev", "tscale", "translation", "phase_window", "metric", "output", "mmap",
+  "interleave", "streaming", "datatype", "raw_width", "raw_height",
+  "raw_pixel", "raw_skip", "prefetch", "workers", "cost_history",
+  "thread_budget", "itk_threads", "shard_index", "shard_count", "merge",
+  "pipeline", "pipeline_depth", "batch_cubes", "prefilter",
+  "prefilter_chunk", "spectral_walk", "chained", "sampling",
+  "sampling_percentage", "sampling_seed", "anchor_step", "anchor_degree",
+  "anchor_tolerance", "demons_tile", "demons_overlap"
+};
+
+// Parameters set on the command line, looked up before params.conf
+static map<string, string> confOverrides;
+
+bool params_known( const string &property ){
+  for ( size_t k = 0; k < sizeof(knownParams)/sizeof(knownParams[0]); k++ ){
+    if ( property == knownParams[k] ){
+      return true;
+    }
+  }
+  return false;
+}
+
+bool params_set( string property, string value ){
+  if ( !params_known( property ) ){
+    return false;
+  }
+  confOverrides[property] = value;
+  return true;
+}
+
+// Value from the overrides if set there, from the config text otherwise
+static string confParam( const string &confText,
+                         const map<string, string> &overrides,
+                         const string &property ){
+  map<string, string>::const_iterator it = overrides.find( property );
+  if ( it != overrides.end() ){
+    return it->second;
+  }
+  return getParam( confText, property );
+}
 
 // Reading parameters from config
 conf_err_t params_read( struct reg_params *params ){
+  conf_err_t reg_errcode = params_read( params, "params.conf", map<string, string>() );
+  if ( reg_errcode == CONF_INVALID_VALUE ){
+    exit(1);
+  }
+  setThreadBudget( params );
+  return reg_errcode;
+}
 
-  string confName = "params.conf";
+// Reading parameters from a named config, with overrides that win
+// over the command line options
+conf_err_t params_read( struct reg_params *params,
+                        const string &confName,
+                        const map<string, string> &overrides ){
 
   // Open for reading
-  FILE *fp = fopen("params.conf", "rt");
+  FILE *fp = fopen(confName.c_str(), "rt");
   if (fp == NULL){
     cout  << "Missing config file. Will use default values."
           << endl;
@@ -541,130 +1597,185 @@ conf_err_t params_read( struct reg_params *params ){
   char confText[MAX_FILE_SIZE] = "";
   int sizeRead = 1;
   int offset = 0;
-  while (sizeRead){
+  while (sizeRead && fp != NULL && offset + MAX_CHAR < MAX_FILE_SIZE){
     sizeRead = fread(confText + offset, sizeof(char), MAX_CHAR, fp);
     offset += sizeRead/sizeof(char);
   }
+  string conf = confText;
+  conf_err_t reg_errcode = CONF_NO_ERR;
+  // insert keeps the job's value where both set a variable
+  map<string, string> set = overrides;
+  set.insert( confOverrides.begin(), confOverrides.end() );
 
   // Extract parameters from config
-  string regmethod  = getParam(confText, "regmethod"    );
-  string reg_name   = getParam(confText, "reg_name"     );
-  string diff_conf  = getParam(confText, "diff_conf"    );
-  string diff_name  = getParam(confText, "diff_name"    );
-  string median     = getParam(confText, "median"       );
-  string radius     = getParam(confText, "radius"       );
-  string gradient   = getParam(confText, "gradient"     );
-  string sigma      = getParam(confText, "sigma"        );
-  string angle      = getParam(confText, "angle"        );
-  string scale      = getParam(confText, "scale"        );
-  string lrate      = getParam(confText, "lrate"        );
-  string slength    = getParam(confText, "slength"      );
-  string niter      = getParam(confText, "niter"        );
+  string regmethod  = confParam(conf, set, "regmethod"    );
+  string reg_name   = confParam(conf, set, "reg_name"     );
+  string diff_conf  = confParam(conf, set, "diff_conf"    );
+  string diff_name  = confParam(conf, set, "diff_name"    );
+  string median     = confParam(conf, set, "median"       );
+  string radius     = confParam(conf, set, "radius"       );
+  string gradient   = confParam(conf, set, "gradient"     );
+  string sigma      = confParam(conf, set, "sigma"        );
+  string angle      = confParam(conf, set, "angle"        );
+  string scale      = confParam(conf, set, "scale"        );
+  string lrate      = confParam(conf, set, "lrate"        );
+  string slength    = confParam(conf, set, "slength"      );
+  string niter      = confParam(conf, set, "niter"        );
   string numberOfLevels
-                    = getParam(confText, "numoflev"     );
+                    = confParam(conf, set, "numoflev"     );
   string translationScale
-                    = getParam(confText, "tscale"       );
+                    = confParam(conf, set, "tscale"       );
   string translation
-                    = getParam(confText, "translation"  );
-  string metric     = getParam(confText, "metric"       );
-  string output     = getParam(confText, "output"       );
-
-  cout << "Reading parameters from params.conf" << endl;
+                    = confParam(conf, set, "translation"  );
+  string phase_window
+                    = confParam(conf, set, "phase_window" );
+  string metric     = confParam(conf, set, "metric"       );
+  string output     = confParam(conf, set, "output"       );
+  string mmap       = confParam(conf, set, "mmap"         );
+  string interleave = confParam(conf, set, "interleave"   );
+  string streaming  = confParam(conf, set, "streaming"    );
+  string datatype   = confParam(conf, set, "datatype"     );
+  string raw_width  = confParam(conf, set, "raw_width"    );
+  string raw_height = confParam(conf, set, "raw_height"   );
+  string raw_datatype
+                    = confParam(conf, set, "raw_pixel"    );
+  string raw_skip   = confParam(conf, set, "raw_skip"     );
+  string prefetch   = confParam(conf, set, "prefetch"     );
+  string workers    = confParam(conf, set, "workers"      );
+  string cost_history
+                    = confParam(conf, set, "cost_history" );
+  string thread_budget
+                    = confParam(conf, set, "thread_budget");
+  string itk_threads
+                    = confParam(conf, set, "itk_threads"  );
+  string shard_index
+                    = confParam(conf, set, "shard_index"  );
+  string shard_count
+                    = confParam(conf, set, "shard_count"  );
+  string merge      = confParam(conf, set, "merge"        );
+  string pipeline   = confParam(conf, set, "pipeline"     );
+  string batch_cubes
+                    = confParam(conf, set, "batch_cubes"  );
+  string prefilter  = confParam(conf, set, "prefilter"    );
+  string spectral_walk
+                    = confParam(conf, set, "spectral_walk");
+  string chained    = confParam(conf, set, "chained"      );
+  string sampling   = confParam(conf, set, "sampling"     );
+  string sampling_percentage
+                    = confParam(conf, set, "sampling_percentage");
+  string sampling_seed
+                    = confParam(conf, set, "sampling_seed");
+  string anchor_step
+                    = confParam(conf, set, "anchor_step"  );
+  string anchor_degree
+                    = confParam(conf, set, "anchor_degree");
+  string anchor_tolerance
+                    = confParam(conf, set, "anchor_tolerance");
+  string demons_tile
+                    = confParam(conf, set, "demons_tile"  );
+  string demons_overlap
+                    = confParam(conf, set, "demons_overlap");
+  string prefilter_chunk
+                    = confParam(conf, set, "prefilter_chunk");
+  string pipeline_depth
+                    = confParam(conf, set, "pipeline_depth");
+
+  cout << "Reading parameters from " << confName << endl;
 
   // Convert strings to values
   // Set default values for missing strings
-  if (regmethod.empty() || fp == NULL ){
+  if (regmethod.empty() ){
     params->regmethod = 1;
     cout << "Missing regmethod, setting to default value: "
       << params->regmethod << endl;
   } else {
     params->regmethod = strtod(regmethod.c_str(), NULL);
   }
-  if (reg_name.empty() || fp == NULL ){
+  if (reg_name.empty() ){
     params->reg_name = "out";
     cout << "Missing reg_name, setting to default value: "
       << params->reg_name << endl;
   } else {
     params->reg_name = reg_name;
   }
-  if (diff_conf.empty() || fp == NULL ){
+  if (diff_conf.empty() ){
     params->diff_conf = 1;
     cout << "Missing diff_conf, setting to default value: "
       << params->diff_conf << endl;
   } else {
     params->diff_conf = strtod(diff_conf.c_str(), NULL);
   }
-  if (diff_name.empty() || fp == NULL ){
+  if (diff_name.empty() ){
     params->diff_name = "diffout";
     cout << "Missing diff_name, setting to default value: "
       << params->regmethod << endl;
   } else {
     params->diff_name = diff_name;
   }
-  if (median.empty() || fp == NULL ){
+  if (median.empty() ){
     params->median    = 1;
     cout << "Missing median, setting to default value: "
       << params->median << endl;
   } else {
     params->median    = strtod(median.c_str(),    NULL);
   }
-  if (radius.empty() || fp == NULL ){
+  if (radius.empty() ){
     params->radius    = 1;
     cout << "Missing radius, setting to default value: "
       << params->radius << endl;
   } else {
     params->radius    = strtod(radius.c_str(),    NULL);
   }
-  if (gradient.empty() || fp == NULL ){
+  if (gradient.empty() ){
     params->gradient  = 0;
     cout << "Missing gradient, setting to default value: "
       << params->gradient << endl;
   } else {
     params->gradient  = strtod(gradient.c_str(),  NULL);
   }
-  if (sigma.empty() || fp == NULL ){
+  if (sigma.empty() ){
     params->sigma     = 1;
     cout << "Missing sigma, setting to default value: "
       << params->sigma << endl;
   } else {
     params->sigma     = strtod(sigma.c_str(),     NULL);
   }
-  if (angle.empty() || fp == NULL ){
+  if (angle.empty() ){
     params->angle     = 0.0;
     cout << "Missing angle, setting to default value: "
       << params->angle << endl;
   } else {
     params->angle     = strtod(angle.c_str(),     NULL);
   }
-  if (scale.empty() || fp == NULL ){
+  if (scale.empty() ){
     params->scale     = 1.0;
     cout << "Missing scale, setting to default value: "
       << params->scale << endl;
   } else {
     params->scale     = strtod(scale.c_str(),     NULL);
   }
-  if (lrate.empty() || fp == NULL ){
+  if (lrate.empty() ){
     params->lrate     = 1.0;
     cout << "Missing lrate, setting to default value: "
       << params->lrate << endl;
   } else {
     params->lrate     = strtod(lrate.c_str(),     NULL);
   }
-  if (slength.empty() || fp == NULL ){
+  if (slength.empty() ){
     params->slength   = 0.0001;
     cout << "Missing slength, setting to default value: "
       << params->slength << endl;
   } else {
     params->slength   = strtod(slength.c_str(),   NULL);
   }
-  if (niter.empty() || fp == NULL ){
+  if (niter.empty() ){
     params->niter     = 300;
     cout << "Missing niter, setting to default value: "
       << params->niter << endl;
   } else {
     params->niter     = strtod(niter.c_str(),     NULL);
   }
-  if (numberOfLevels.empty() || fp == NULL ){
+  if (numberOfLevels.empty() ){
     params->numberOfLevels
                       = 1;
     cout << "Missing numoflev, setting to default value: "
@@ -674,7 +1785,7 @@ conf_err_t params_read( struct reg_params *params ){
                       = strtod(numberOfLevels.c_str(),
                                                   NULL);
   }
-  if (translationScale.empty() || fp == NULL ){
+  if (translationScale.empty() ){
     params->translationScale
                       = 0.001;
     cout << "Missing tscale, setting to default value: "
@@ -684,7 +1795,7 @@ conf_err_t params_read( struct reg_params *params ){
                       = strtod(translationScale.c_str(),
                                                   NULL);
   }
-  if (translation.empty() || fp == NULL ){
+  if (translation.empty() ){
     params->translation
                       = 0;
     cout << "Missing translation, setting to default value: "
@@ -694,23 +1805,353 @@ conf_err_t params_read( struct reg_params *params ){
                       = strtod(translation.c_str(),
                                                   NULL);
   }
-  if (metric.empty() || fp == NULL ){
+  if (phase_window.empty() ){
+    params->phase_window
+                      = PHASE_WINDOW;
+    cout << "Missing phase_window, setting to default value: "
+      << params->phase_window << endl;
+  } else {
+    params->phase_window
+                      = strtod(phase_window.c_str(),
+                                                  NULL);
+  }
+  if (params->phase_window < 2){
+    cout << "phase_window must be at least 2, using 2" << endl;
+    params->phase_window
+                      = 2;
+  }
+  if (metric.empty() ){
     params->metric    = 0;
-    cout << "Missing translation, setting to default value: "
+    cout << "Missing metric, setting to default value: "
       << params->metric << endl;
   } else {
-    params->metric    = strtod(translation.c_str(),
+    params->metric    = strtod(metric.c_str(),
                                                   NULL);
   }
-  if (output.empty() || fp == NULL ){
+  if (output.empty() ){
     params->output    = 1;
     cout << "Missing output, setting to default value: "
       << params->output << endl;
   } else {
     params->output    = strtod(output.c_str(),    NULL);
   }
+  if (mmap.empty() ){
+    params->mmap      = 0;
+    cout << "Missing mmap, setting to default value: "
+      << params->mmap << endl;
+  } else {
+    params->mmap      = strtod(mmap.c_str(),      NULL);
+  }
+  if (interleave.empty() ){
+    params->interleave
+                      = BIL_INTERLEAVE;
+    cout << "Missing interleave, setting to default value: bil"
+      << endl;
+  } else if (interleave == "bsq"){
+    params->interleave
+                      = BSQ_INTERLEAVE;
+  } else {
+    params->interleave
+                      = BIL_INTERLEAVE;
+  }
+  if (streaming.empty() ){
+    params->streaming = 0;
+    cout << "Missing streaming, setting to default value: "
+      << params->streaming << endl;
+  } else {
+    params->streaming = strtod(streaming.c_str(), NULL);
+  }
+  if (datatype.empty() ){
+    params->datatype  = 0;
+    cout << "Missing datatype, setting to default value: "
+      << params->datatype << endl;
+  } else {
+    params->datatype  = strtod(datatype.c_str(),  NULL);
+  }
+  if (params->datatype != 0 && hyperspectral_datatype_bytes(params->datatype) == 0){
+    cout << "Unsupported datatype " << params->datatype
+      << ", using the input datatype" << endl;
+    params->datatype  = 0;
+  }
+  if (raw_width.empty() ){
+    params->raw_width = 1024;
+    cout << "Missing raw_width, setting to default value: "
+      << params->raw_width << endl;
+  } else {
+    params->raw_width = strtod(raw_width.c_str(), NULL);
+  }
+  if (raw_height.empty() ){
+    params->raw_height
+                      = 768;
+    cout << "Missing raw_height, setting to default value: "
+      << params->raw_height << endl;
+  } else {
+    params->raw_height
+                      = strtod(raw_height.c_str(),
+                                                  NULL);
+  }
+  if (raw_datatype.empty() ){
+    params->raw_datatype
+                      = 12;
+    cout << "Missing raw_pixel, setting to default value: "
+      << params->raw_datatype << endl;
+  } else {
+    params->raw_datatype
+                      = strtod(raw_datatype.c_str(),
+                                                  NULL);
+  }
+  if (raw_skip.empty() ){
+    params->raw_skip  = 0;
+    cout << "Missing raw_skip, setting to default value: "
+      << params->raw_skip << endl;
+  } else {
+    params->raw_skip  = strtod(raw_skip.c_str(),  NULL);
+  }
+  if (prefetch.empty() ){
+    params->prefetch  = 2;
+    cout << "Missing prefetch, setting to default value: "
+      << params->prefetch << endl;
+  } else {
+    params->prefetch  = strtod(prefetch.c_str(),  NULL);
+  }
+  if (params->prefetch < 1){
+    cout << "prefetch must be at least 1, using 1" << endl;
+    params->prefetch  = 1;
+  }
+  if (workers.empty() ){
+    params->workers   = 1;
+    cout << "Missing workers, setting to default value: "
+      << params->workers << endl;
+  } else {
+    params->workers   = strtod(workers.c_str(),   NULL);
+  }
+  if (thread_budget.empty() ){
+    params->thread_budget
+                      = 0;
+    cout << "Missing thread_budget, setting to default value: "
+      << params->thread_budget << endl;
+  } else {
+    params->thread_budget
+                      = strtod(thread_budget.c_str(),
+                                                  NULL);
+  }
+  if (itk_threads.empty() ){
+    params->itk_threads
+                      = 0;
+    cout << "Missing itk_threads, setting to default value: "
+      << params->itk_threads << endl;
+  } else {
+    params->itk_threads
+                      = strtod(itk_threads.c_str(),
+                                                  NULL);
+  }
+  if (shard_count.empty() ){
+    params->shard_count
+                      = 1;
+    cout << "Missing shard_count, setting to default value: "
+      << params->shard_count << endl;
+  } else {
+    params->shard_count
+                      = strtod(shard_count.c_str(),
+                                                  NULL);
+  }
+  if (shard_index.empty() ){
+    params->shard_index
+                      = 0;
+    cout << "Missing shard_index, setting to default value: "
+      << params->shard_index << endl;
+  } else {
+    params->shard_index
+                      = strtod(shard_index.c_str(),
+                                                  NULL);
+  }
+  if (params->shard_count < 1 || params->shard_index < 0
+      || params->shard_index >= params->shard_count){
+    cerr << "Invalid shard " << params->shard_index
+      << " of " << params->shard_count << endl;
+    params->shard_index = 0;
+    params->shard_count = 1;
+    reg_errcode = CONF_INVALID_VALUE;
+  }
+  if (merge.empty() ){
+    params->merge     = 0;
+    cout << "Missing merge, setting to default value: "
+      << params->merge << endl;
+  } else {
+    params->merge     = strtod(merge.c_str(),     NULL);
+  }
+  if (pipeline.empty() ){
+    params->pipeline  = 0;
+    cout << "Missing pipeline, setting to default value: "
+      << params->pipeline << endl;
+  } else {
+    params->pipeline  = strtod(pipeline.c_str(),  NULL);
+  }
+  if (pipeline_depth.empty() ){
+    params->pipeline_depth
+                      = 2;
+    cout << "Missing pipeline_depth, setting to default value: "
+      << params->pipeline_depth << endl;
+  } else {
+    params->pipeline_depth
+                      = strtod(pipeline_depth.c_str(),
+                                                  NULL);
+  }
+  if (params->pipeline_depth < 1){
+    cout << "pipeline_depth must be at least 1, using 1" << endl;
+    params->pipeline_depth
+                      = 1;
+  }
+  if (spectral_walk.empty() ){
+    params->spectral_walk
+                      = 0;
+    cout << "Missing spectral_walk, setting to default value: "
+      << params->spectral_walk << endl;
+  } else {
+    params->spectral_walk
+                      = strtod(spectral_walk.c_str(),
+                                                  NULL);
+  }
+  if (chained.empty() ){
+    params->chained   = 0;
+    cout << "Missing chained, setting to default value: "
+      << params->chained << endl;
+  } else {
+    params->chained   = strtod(chained.c_str(),
+                                                  NULL);
+  }
+  if (sampling.empty() ){
+    params->sampling  = 0;
+    cout << "Missing sampling, setting to default value: none" << endl;
+  } else if (sampling == "none" ){
+    params->sampling  = 0;
+  } else if (sampling == "regular" ){
+    params->sampling  = 1;
+  } else if (sampling == "random" ){
+    params->sampling  = 2;
+  } else {
+    cerr << "Unknown sampling " << sampling << ", use none, regular or random" << endl;
+    params->sampling  = 0;
+    reg_errcode = CONF_INVALID_VALUE;
+  }
+  if (sampling_percentage.empty() ){
+    params->sampling_percentage
+                      = 0.1;
+    cout << "Missing sampling_percentage, setting to default value: "
+      << params->sampling_percentage << endl;
+  } else {
+    params->sampling_percentage
+                      = strtod(sampling_percentage.c_str(),
+                                                  NULL);
+  }
+  if (params->sampling_percentage <= 0.0 || params->sampling_percentage > 1.0){
+    cerr << "sampling_percentage must be above 0 and at most 1" << endl;
+    params->sampling_percentage
+                      = 0.1;
+    reg_errcode = CONF_INVALID_VALUE;
+  }
+  if (sampling_seed.empty() ){
+    params->sampling_seed
+                      = 121212;
+    cout << "Missing sampling_seed, setting to default value: "
+      << params->sampling_seed << endl;
+  } else {
+    params->sampling_seed
+                      = strtod(sampling_seed.c_str(),
+                                                  NULL);
+  }
+  if (anchor_step.empty() ){
+    params->anchor_step
+                      = 0;
+    cout << "Missing anchor_step, setting to default value: "
+      << params->anchor_step << endl;
+  } else {
+    params->anchor_step
+                      = strtod(anchor_step.c_str(),
+                                                  NULL);
+  }
+  if (anchor_degree.empty() ){
+    params->anchor_degree
+                      = 2;
+    cout << "Missing anchor_degree, setting to default value: "
+      << params->anchor_degree << endl;
+  } else {
+    params->anchor_degree
+                      = strtod(anchor_degree.c_str(),
+                                                  NULL);
+  }
+  if (anchor_tolerance.empty() ){
+    params->anchor_tolerance
+                      = 0.02;
+    cout << "Missing anchor_tolerance, setting to default value: "
+      << params->anchor_tolerance << endl;
+  } else {
+    params->anchor_tolerance
+                      = strtod(anchor_tolerance.c_str(),
+                                                  NULL);
+  }
+  if (demons_tile.empty() ){
+    params->demons_tile
+                      = 0;
+    cout << "Missing demons_tile, setting to default value: "
+      << params->demons_tile << endl;
+  } else {
+    params->demons_tile
+                      = strtod(demons_tile.c_str(),
+                                                  NULL);
+  }
+  if (demons_overlap.empty() ){
+    params->demons_overlap
+                      = 64;
+    cout << "Missing demons_overlap, setting to default value: "
+      << params->demons_overlap << endl;
+  } else {
+    params->demons_overlap
+                      = strtod(demons_overlap.c_str(),
+                                                  NULL);
+  }
+  if (prefilter.empty() ){
+    params->prefilter = 0;
+    cout << "Missing prefilter, setting to default value: "
+      << params->prefilter << endl;
+  } else {
+    params->prefilter = strtod(prefilter.c_str(),
+                                                  NULL);
+  }
+  if (prefilter_chunk.empty() ){
+    params->prefilter_chunk
+                      = 0;
+    cout << "Missing prefilter_chunk, setting to default value: "
+      << params->prefilter_chunk << endl;
+  } else {
+    params->prefilter_chunk
+                      = strtod(prefilter_chunk.c_str(),
+                                                  NULL);
+  }
+  if (batch_cubes.empty() ){
+    params->batch_cubes
+                      = 1;
+    cout << "Missing batch_cubes, setting to default value: "
+      << params->batch_cubes << endl;
+  } else {
+    params->batch_cubes
+                      = strtod(batch_cubes.c_str(),
+                                                  NULL);
+  }
+  if (cost_history.empty() ){
+    params->cost_history
+                      = 1;
+    cout << "Missing cost_history, setting to default value: "
+      << params->cost_history << endl;
+  } else {
+    params->cost_history
+                      = strtod(cost_history.c_str(),
+                                                  NULL);
+  }
 
-  fclose(fp);
+  if (fp != NULL){
+    fclose(fp);
+  }
   cout  << "Parameters:"           << endl
         << endl
         << "Registration method: " << params->regmethod
@@ -745,12 +2186,102 @@ conf_err_t params_read( struct reg_params *params ){
         << endl
         << "Translation: "         << params->translation
         << endl
+        << "Phase window: "        << params->phase_window
+        << endl
         << "Metric: "              << params->metric
         << endl
         << "Output: "              << params->output
+        << endl
+        << "Memory-mapped input: " << params->mmap
+        << endl
+        << "Output interleave: "   << (params->interleave == BSQ_INTERLEAVE ? "bsq" : "bil")
+        << endl
+        << "Streaming: "           << params->streaming
+        << endl
+        << "Output datatype: "     << params->datatype
+        << endl
+        << "Raw frame size: "      << params->raw_width
+        << "x"                     << params->raw_height
+        << endl
+        << "Raw datatype: "        << params->raw_datatype
+        << endl
+        << "Raw header bytes: "    << params->raw_skip
+        << endl
+        << "Raw frames read ahead: "
+                                   << params->prefetch
+        << endl
+        << "Band workers: "        << params->workers
+        << endl
+        << "Band cost history: "   << params->cost_history
+        << endl
+        << "Shard: "               << params->shard_index
+        << " of "                  << params->shard_count
+        << endl
+        << "Merge shards: "        << params->merge
+        << endl
+        << "Stage pipeline: "      << params->pipeline
+        << ", depth "              << params->pipeline_depth
+        << endl
+        << "Batch cubes at a time: "
+                                   << params->batch_cubes
+        << endl
+        << "Prefilter: "           << params->prefilter
+        << ", chunk "              << params->prefilter_chunk
+        << endl
+        << "Spectral walk: "       << params->spectral_walk
+        << ", chained "            << params->chained
+        << endl
+        << "Metric sampling: "     << params->sampling
+        << ", "                    << params->sampling_percentage
+        << " of the pixels, seed " << params->sampling_seed
+        << endl
+        << "Anchor bands: every "  << params->anchor_step
+        << ", degree "             << params->anchor_degree
+        << ", tolerance "          << params->anchor_tolerance
         << endl;
+  if ( params->regmethod == 6 && params->demons_tile > 0 ){
+    cout  << "Demons strips: "     << params->demons_tile
+          << " lines, overlap "    << params->demons_overlap
+          << endl;
+  }
 
-  return CONF_NO_ERR;
+  return reg_errcode;
+}
+
+// Split the thread budget into band workers and itk threads per band, and
+// limit itk to its share before any filter or registration is created
+void setThreadBudget( struct reg_params *params ){
+  int total = params->thread_budget;
+  if ( total < 1 ){
+    total = thread::hardware_concurrency();
+  }
+  if ( total < 1 ){
+    total = 1;
+  }
+  params->thread_budget = total;
+
+  if ( params->workers < 1 && params->itk_threads < 1 ){
+    // Bands scale better than itk threads on a single band
+    params->itk_threads = 1;
+  }
+  if ( params->workers < 1 ){
+    params->workers     = max( 1, total / params->itk_threads );
+  }
+  if ( params->itk_threads < 1 ){
+    params->itk_threads = max( 1, total / params->workers );
+  }
+  if ( params->workers * params->itk_threads > total ){
+    cout  << "Warning: " << params->workers << " band workers x "
+          << params->itk_threads << " itk threads is more than the thread budget of "
+          << total << endl;
+  }
+
+  ThreaderType::SetGlobalMaximumNumberOfThreads( params->itk_threads );
+  ThreaderType::SetGlobalDefaultNumberOfThreads( params->itk_threads );
+
+  cout  << "Threads: " << params->workers << " band workers x "
+        << params->itk_threads << " itk threads, budget "
+        << total << endl;
 }
 
 // Read config file with regex
@@ -759,10 +2290,11 @@ string getParam(string confText, string property){
   int numMatch = 2;
   regmatch_t *matchArray = (regmatch_t*)malloc(sizeof(regmatch_t)*numMatch);
 
-  char regexExpr[MAX_CHAR] = "";
+  char regexExpr[MAX_CHAR] = "^[ \t]*";
   strcat(regexExpr, property.c_str());
-  //property followed by = and a set of number or dots
-  strcat(regexExpr, "\\s*=\\s*([0-9|.|a-z|\"|]+)");
+  //property at the start of a line, followed by = and a value up to
+  //the next space on the same line, so an empty value reads as missing
+  strcat(regexExpr, "[ \t]*=[ \t]*(\\S+)");
 
   int retcode = regcomp(&propertyMatch, regexExpr, REG_EXTENDED | REG_NEWLINE | REG_PERL);
   int match = regexec(&propertyMatch, confText.c_str(), numMatch, matchArray, 0);
@@ -773,6 +2305,10 @@ string getParam(string confText, string property){
   } else {
     retVal = confText.substr(matchArray[1].rm_so, matchArray[1].rm_eo - matchArray[1].rm_so);
   }
+  //quoted values keep what is between the quotes
+  if (retVal.size() >= 2 && retVal[0] == '"' && retVal[retVal.size() - 1] == '"'){
+    retVal = retVal.substr(1, retVal.size() - 2);
+  }
 
   //cleanup
   regfree(&propertyMatch);
@@ -804,19 +2340,17 @@ ImageType::Pointer imageMatContainer(
   return container;
 }
 
+// Band i of the .mat is stored column-major, so the image is
+// its transpose: pixel (j, k) is hData[k + xSize*j + xSize*ySize*i]
 ImageType::Pointer readMat( ImageType* const itkmat,
                                 int i,
                                 unsigned xSize,
                                 unsigned ySize,
                                 float *hData ){
-  for (int j=0; j < ySize; j++) {
-    for (int k=0; k < xSize; k++) {
-      ImageType::IndexType pixelIndex;
-      pixelIndex[0] = j;
-      pixelIndex[1] = k;
-      itkmat->SetPixel(pixelIndex, hData[k + xSize*j + xSize*ySize*i]);
-    }
-  }
+  copyStrided( hData + (size_t)xSize*ySize*i, 1, xSize,
+               itkmat->GetBufferPointer(), ySize, 1,
+               xSize, ySize );
+  itkmat->Modified();
   return itkmat;
 }
 
@@ -825,39 +2359,9 @@ float* writeMat(            ImageType* const itkmat,
                             int i,
                             unsigned xSize,
                             unsigned ySize ){
-  for ( int j=0; j < ySize; j++ ){
-    for ( int k=0; k < xSize; k++ ){
-      ImageType::IndexType pixelIndex;
-      pixelIndex[0] = j;
-      pixelIndex[1] = k;
-      hData[k + xSize*j + xSize*ySize*i]
-        = itkmat->GetPixel(pixelIndex);
-    }
-  }
+  copyStrided( itkmat->GetBufferPointer(), ySize, 1,
+               hData + (size_t)xSize*ySize*i, 1, xSize,
+               xSize, ySize );
   return hData;
 }
 
-void outMat(                float *hData,
-                            string outname,
-                            matvar_t *wavelengthsd,
-                            matvar_t *HSId ){
-
-  // Prepare
-  size_t dim3d[3] = { HSId->dims[0], HSId->dims[1], HSId->dims[2] };
-  outname += ".mat";
-
-  mat_t *matout;
-
-  // Write
-  matout = Mat_CreateVer(outname.c_str(),NULL,MAT_FT_MAT5);
-  Mat_VarWrite( matout, wavelengthsd, MAT_COMPRESSION_ZLIB );
-
-  matvar_t *HSIout = Mat_VarCreate("HSI", MAT_C_SINGLE, MAT_T_SINGLE, HSId->rank, dim3d, static_cast<void*>(hData), 0);
-  Mat_VarWrite( matout, HSIout, MAT_COMPRESSION_ZLIB );
-
-  Mat_VarFree(wavelengthsd);
-  Mat_VarFree(HSIout);
-  Mat_VarFree(HSId);
-
-  Mat_Close(matout);
-}
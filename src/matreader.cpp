@@ -0,0 +1,139 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "matreader.h"
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+using namespace std;
+
+// Bytes per element of the classes the reader converts, 0 for others
+static size_t classBytes( enum matio_classes classType ){
+  switch ( classType ){
+    case MAT_C_DOUBLE: return sizeof(double);
+    case MAT_C_SINGLE: return sizeof(float);
+    case MAT_C_INT8:   return sizeof(int8_t);
+    case MAT_C_UINT8:  return sizeof(uint8_t);
+    case MAT_C_INT16:  return sizeof(int16_t);
+    case MAT_C_UINT16: return sizeof(uint16_t);
+    case MAT_C_INT32:  return sizeof(int32_t);
+    case MAT_C_UINT32: return sizeof(uint32_t);
+    default:           return 0;
+  }
+}
+
+template<typename T>
+static void convertBand( const char *raw, size_t n, float *data ){
+  const T *values = reinterpret_cast<const T*>( raw );
+  for ( size_t k=0; k < n; k++ ){
+    data[k] = (float)values[k];
+  }
+}
+
+// A band in the class of the variable, converted to float
+static void bandToFloat( const char *raw, enum matio_classes classType,
+                         size_t n, float *data ){
+  switch ( classType ){
+    case MAT_C_DOUBLE: convertBand<double>(   raw, n, data ); break;
+    case MAT_C_SINGLE: memcpy( data, raw, sizeof(float)*n );  break;
+    case MAT_C_INT8:   convertBand<int8_t>(   raw, n, data ); break;
+    case MAT_C_UINT8:  convertBand<uint8_t>(  raw, n, data ); break;
+    case MAT_C_INT16:  convertBand<int16_t>(  raw, n, data ); break;
+    case MAT_C_UINT16: convertBand<uint16_t>( raw, n, data ); break;
+    case MAT_C_INT32:  convertBand<int32_t>(  raw, n, data ); break;
+    case MAT_C_UINT32: convertBand<uint32_t>( raw, n, data ); break;
+    default: break;
+  }
+}
+
+bool MatBandReader::supported( const matvar_t *info ){
+  return info->rank == 3 && !info->isComplex && classBytes( info->class_type ) > 0;
+}
+
+MatBandReader::MatBandReader( mat_t *matfp,
+                              matvar_t *info,
+                              const vector<int> &order,
+                              size_t depth )
+  : matfp( matfp ),
+    info( info ),
+    order( order ),
+    bandSize( info->dims[0]*info->dims[1] ),
+    elementBytes( classBytes( info->class_type ) ),
+    queue( depth ){
+  thread = std::thread( &MatBandReader::run, this );
+}
+
+MatBandReader::~MatBandReader(){
+  queue.close();
+  thread.join();
+}
+
+bool MatBandReader::nextBand( int &band,
+                              vector<float> &data ){
+  MatBand next;
+  if ( !queue.pop( next ) ){
+    // Set before the queue was closed
+    if ( !error.empty() ){
+      throw runtime_error( error );
+    }
+    return false;
+  }
+  band = next.band;
+  data.swap( next.data );
+  return true;
+}
+
+// Reader thread, the only user of matfp while it runs
+void MatBandReader::run(){
+
+  // Hyperslabs of a zlib compressed MAT5 variable are inflated from the
+  // start of the variable on every read, which is quadratic in the number
+  // of bands. Those are inflated once instead, so the whole cube is held
+  // in memory while the bands are read.
+  matvar_t *whole = NULL;
+  if ( Mat_GetVersion( matfp ) == MAT_FT_MAT5
+        && info->compression == MAT_COMPRESSION_ZLIB ){
+    whole = Mat_VarRead( matfp, info->name );
+    if ( whole == NULL ){
+      error = string( "could not read " ) + info->name;
+      queue.close();
+      return;
+    }
+  }
+
+  // Bands are read in the class of the variable and converted to float
+  vector<char> raw( whole != NULL ? 0 : bandSize*elementBytes );
+  for ( size_t n=0; n < order.size(); n++ ){
+    MatBand next;
+    next.band = order[n];
+    next.data.resize( bandSize );
+
+    if ( whole != NULL ){
+      bandToFloat( static_cast<const char*>(whole->data) + bandSize*elementBytes*next.band,
+        info->class_type, bandSize, &next.data[0] );
+    } else {
+      int start[3]  = { 0, 0, next.band };
+      int stride[3] = { 1, 1, 1 };
+      int edge[3]   = { (int)info->dims[0], (int)info->dims[1], 1 };
+      if ( Mat_VarReadData( matfp, info, &raw[0], start, stride, edge ) != 0 ){
+        error = "could not read band " + to_string( next.band ) + " of " + info->name;
+        break;
+      }
+      bandToFloat( &raw[0], info->class_type, bandSize, &next.data[0] );
+    }
+
+    if ( !queue.push( std::move( next ) ) ){
+      break;
+    }
+  }
+  queue.close();
+
+  if ( whole != NULL ){
+    Mat_VarFree( whole );
+  }
+}
@@ -0,0 +1,95 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "matwriter.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+using namespace std;
+
+// MAT5 data types and array class, from the MAT-file format
+static const uint32_t MI_INT8         = 1;
+static const uint32_t MI_INT32        = 5;
+static const uint32_t MI_UINT32       = 6;
+static const uint32_t MI_SINGLE       = 7;
+static const uint32_t MI_MATRIX       = 14;
+static const uint32_t MX_SINGLE_CLASS = 7;
+
+// Data elements start on 8 byte boundaries
+static size_t padded( size_t bytes ){
+  return ( bytes + 7 ) & ~(size_t)7;
+}
+
+MatBandWriter::MatBandWriter( const string &name,
+                              matvar_t *wavelengths,
+                              const size_t *dims )
+  : path( name + ".mat" ),
+    fd( -1 ),
+    bandBytes( sizeof(float)*dims[0]*dims[1] ){
+
+  mat_t *matout = Mat_CreateVer( path.c_str(), NULL, MAT_FT_MAT5 );
+  if ( matout == NULL ){
+    throw runtime_error( "could not create " + path );
+  }
+  Mat_VarWrite( matout, wavelengths, MAT_COMPRESSION_ZLIB );
+  Mat_Close( matout );
+
+  // An element holds its size in 32 bits
+  size_t dataBytes = bandBytes*dims[2];
+  if ( dataBytes > 0xFFFFFFFFu - 72 ){
+    throw runtime_error( "cube too large for a MAT5 file: " + path );
+  }
+
+  // miMATRIX element of the cube: array flags, dimensions, name and the
+  // tag of the real part, whose data follows
+  uint32_t header[16] = {
+    MI_MATRIX,  (uint32_t)( 64 + padded( dataBytes ) ),
+    MI_UINT32,  8,
+    MX_SINGLE_CLASS, 0,
+    MI_INT32,   12,
+    (uint32_t)dims[0], (uint32_t)dims[1],
+    (uint32_t)dims[2], 0,
+    MI_INT8,    3,
+    0,          0,
+  };
+  memcpy( &header[14], "HSI", 3 );
+  uint32_t realTag[2] = { MI_SINGLE, (uint32_t)dataBytes };
+
+  fd = open( path.c_str(), O_RDWR );
+  off_t start = fd < 0 ? -1 : lseek( fd, 0, SEEK_END );
+  dataStart = start + sizeof(header) + sizeof(realTag);
+  if ( start < 0
+      || pwrite( fd, header, sizeof(header), start ) != (ssize_t)sizeof(header)
+      || pwrite( fd, realTag, sizeof(realTag), start + sizeof(header) ) != (ssize_t)sizeof(realTag)
+      || ftruncate( fd, dataStart + padded( dataBytes ) ) != 0 ){
+    close();
+    throw runtime_error( "could not write " + path );
+  }
+}
+
+MatBandWriter::~MatBandWriter(){
+  close();
+}
+
+void MatBandWriter::writeBand( int band,
+                               const float *data ){
+  if ( pwrite( fd, data, bandBytes, dataStart + (off_t)bandBytes*band ) != (ssize_t)bandBytes ){
+    throw runtime_error( "could not write band " + to_string( band ) + " to " + path );
+  }
+}
+
+void MatBandWriter::close(){
+  if ( fd >= 0 ){
+    ::close( fd );
+    fd = -1;
+  }
+}
@@ -8,256 +8,168 @@
 #include "multispec.h"
 #include "hyperspec.h"
 #include "registration.h"
+#include "framereader.h"
+#include "bandview.h"
 #include "fstream"
 #include "iostream"
 #include "inttypes.h"
+#include "vector"
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
 using namespace std;
 
 void multispec_raw( int argc, char *argv[] ){
 
+  // Read parameters config
+  struct reg_params params;
+  conf_err_t reg_errcode = params_read( &params );
+
+  multispec_raw( argc, argv, params );
+}
+
+void multispec_raw( int argc, char *argv[], struct reg_params params ){
+
   if ( argc < 2){
     cerr << "Missing raw files." << endl;
     exit(1);
   }
 
-  // Read parameters config
-  struct reg_params params;
-  conf_err_t reg_errcode = params_read( &params );
+  // Size and pixel type of input files
+  struct hyspex_header header = rawHeader( params, argv[1] );
 
-  // Known size of input files
-  int xsize = 1024;
-  int ysize = 768;
-
-  // Input images
-  UintImageType::Pointer fixed_raw    = rawContainer( xsize, ysize );
-  UintImageType::Pointer moving_raw   = rawContainer( xsize, ysize );
-  ImageType::Pointer fixed            = imgContainer( xsize, ysize );
-  ImageType::Pointer moving           = imgContainer( xsize, ysize );
-  // Filtered images
-  ImageType::Pointer ffixed           = imgContainer( xsize, ysize );
-  ImageType::Pointer fmoving          = imgContainer( xsize, ysize );
-  // Output images
-  ImageType::Pointer output           = imgContainer( xsize, ysize );
-  ImageType::Pointer outdiff          = imgContainer( xsize, ysize );
-  UintImageType::Pointer output_raw   = rawContainer( xsize, ysize );
-  UintImageType::Pointer outdiff_raw  = rawContainer( xsize, ysize );
-
-  // Difference image
-  DifferenceFilterType::Pointer difference = DifferenceFilterType::New();
-
-  // Initiate pointers
-  ResampleFilterType::Pointer       registration;
+  // Input images, allocated by the frame reader
+  ImageType::Pointer fixed;
+  // Filtered fixed image
+  ImageType::Pointer ffixed;
+
+  // Frames are read and converted to float ahead of the registration
+  FrameReader reader( header, argv + 1, argc - 1, params.prefetch );
+  int n;
 
   // Read fixed image
-  fixed_raw = readRaw(fixed_raw, 1, xsize, ysize, argv[1]);
+  reader.nextFrame( n, fixed );
+  cout << "In: " << argv[1] << endl;
   //Write out with specified naming scheme
-  writeRaw( fixed_raw, 1, xsize, ysize, params.reg_name );
-
-
-  // Cast to float
-  CastFilterFloatType::Pointer fixed_cast_in = castFloatImage( fixed_raw );
-  fixed = fixed_cast_in->GetOutput();
-  fixed->Update();
+  writeRaw( fixed, 1, header, params.reg_name );
 
   /* Uncomment for writing to .tif
   WriterType::Pointer writer = WriterType::New();
   writer->SetFileName( "input1.tif" );
-  writer->SetInput( fixed_raw );
+  writer->SetInput( fixed );
   writer->Update();
   */
 
   // Filter images
-  ffixed = fixed;
-  if ( params.median == 1){
-    ffixed = medianFilter( ffixed, params.radius );
-    ffixed->Update();
-  }
-  if ( params.gradient == 1){
-    ffixed = gradientFilter( ffixed, params.sigma );
-    ffixed->Update();
-  }
-
-  for ( int i=2; i<argc; i++){
-
-    char buffer[32];
-    snprintf(buffer, sizeof(char) * 32, "1%i.tif", i);
-    // Read moving images
-    moving_raw = readRaw(moving_raw, i, xsize, ysize, argv[i] );
-
-    // Cast to float
-    CastFilterFloatType::Pointer moving_cast_in = castFloatImage( moving_raw );
-    moving = moving_cast_in->GetOutput();
-
-    /* Uncomment for writing to .tif
-    WriterType::Pointer writer2 = WriterType::New();
-    string name = "input";
-    name += to_string(i);
-    name += ".tif";
-    writer2->SetFileName( name );
-    writer2->SetInput( moving );
-    writer2->Update();
-    */
-
-    // Filter images
-    fmoving = moving;
-    if ( params.median == 1){
-      fmoving = medianFilter( fmoving, params.radius );
-      fmoving->Update();
-    }
-    if ( params.gradient == 1){
-      fmoving = gradientFilter( fmoving, params.sigma );
-      fmoving->Update();
+  ffixed = filterBand( fixed, params );
+
+  // Each frame's log is held back until all frames before it are logged,
+  // so the log reads as if the frames were registered in order
+  mutex logLock;
+  map<int, string> logs;
+  int nextLog = 2;
+  auto logFrame = [&]( int i, const string &text ){
+    lock_guard<mutex> lock( logLock );
+    logs[i] = text;
+    while ( logs.count( nextLog ) ){
+      cout << logs[nextLog];
+      logs.erase( nextLog++ );
     }
+  };
+
+  // Every frame worker has its own fixed images
+  int frameWorkers = max( 1, min( params.workers, argc - 2 ) );
+  vector<ImageType::Pointer> fixedw, ffixedw;
+  for ( int w=0; w < frameWorkers; w++ ){
+    fixedw.push_back(  copyBand( fixed )  );
+    ffixedw.push_back( copyBand( ffixed ) );
+  }
 
-    WarperType::Pointer warper = WarperType::New();
-    // Throw to registration handler
-    // Rigid transform
-    if (params.regmethod == 1){
-      TransformRigidType::Pointer       rigid_transform;
-      rigid_transform = registration1(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleRigidPointer(
-                                  fixed,
-                                  moving,
-                                  rigid_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-      // Similarity transform
-    } else if (params.regmethod == 2){
-      TransformSimilarityType::Pointer  similarity_transform;
-      similarity_transform = registration2(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleSimilarityPointer(
-                                  fixed,
-                                  moving,
-                                  similarity_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-      // Affine transform
-    } else if (params.regmethod == 3){
-      TransformAffineType::Pointer      affine_transform;
-      affine_transform = registration3(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleAffinePointer(
-                                  fixed,
-                                  moving,
-                                  affine_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-    } else if (params.regmethod == 4){
-      TransformBSplineType::Pointer      bspline_transform;
-      bspline_transform = registration4(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-      registration = resampleBSplinePointer(
-                                  fixed,
-                                  moving,
-                                  bspline_transform );
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-    } else if (params.regmethod == 5){
-      CompositeTransformType::Pointer translation_transform;
-      translation_transform = translation(
-                                  ffixed,
-                                  fmoving,
-                                  params );
-
-      ResampleFilterType::Pointer resample = ResampleFilterType::New();
-      resample->SetTransform(          translation_transform          );
-      resample->SetInput(                     moving                  );
-      resample->SetSize(  fixed->GetLargestPossibleRegion().GetSize() );
-      resample->SetOutputOrigin(         fixed->GetOrigin()           );
-      resample->SetOutputSpacing(        fixed->GetSpacing()          );
-      resample->SetDefaultPixelValue(               0.0               );
-      registration = resample;
-
-      difference = diffFilter(
-                                  moving,
-                                  registration );
-    } else if (params.regmethod == 6){
-      warper = registration5(
-                                  fixed,
-                                  moving,
-                                  params );
-    }
-
-    // Add to output containers
-    if (params.regmethod == 6){
-      output = warper->GetOutput();
-      output->Update();
-    } else {
-      output = registration->GetOutput();
-      output->Update();
-
-      outdiff = difference->GetOutput();
-      outdiff->Update();
+  // Frame workers take the next frame from the reader, each with its
+  // own moving, filtered and output images
+  auto frameWorker = [&]( int w ){
+    ImageType::Pointer moving;
+    int m;
+    while ( reader.nextFrame( m, moving ) ){
+      int i = m + 1;
+      ostringstream log;
+      // Moving image, read ahead by the frame reader
+      log << "In: " << argv[i] << endl;
+
+      /* Uncomment for writing to .tif
+      WriterType::Pointer writer2 = WriterType::New();
+      string name = "input";
+      name += to_string(i);
+      name += ".tif";
+      writer2->SetFileName( name );
+      writer2->SetInput( moving );
+      writer2->Update();
+      */
+
+      ImageType::Pointer output;
+      ImageType::Pointer outdiff;
+      ImageType::Pointer fmoving = filterBand( moving, params );
+      // Same registration as the bands of .img and .mat cubes
+      registerBand( fixedw[w], ffixedw[w], moving, fmoving, params, output, outdiff );
+
+      // Write images
+
+      /* Uncomment for writing to .tif
+      WriterType::Pointer writer3 = WriterType::New();
+      string name2 = params.reg_name;
+      name2 += to_string(i);
+      name2 += ".tif";
+      writer3->SetFileName( name2 );
+      writer3->SetInput( output );
+      writer3->Update();
+      */
+
+      // Names follow the frame number, not the order frames finish in
+      writeRaw( output, i, header, params.reg_name, log );
+
+      // Write diff
+      if ( params.diff_conf == 4 && params.regmethod != 6){
+        writeRaw( outdiff, i, header, params.diff_name, log );
+      }
+
+      log << "Done with " << i << " of " << argc-1 << endl;
+      logFrame( i, log.str() );
     }
-
-    // Write images
-
-    /* Uncomment for writing to .tif
-    WriterType::Pointer writer3 = WriterType::New();
-    string name2 = params.reg_name;
-    name2 += to_string(i);
-    name2 += ".tif";
-    writer3->SetFileName( name2 );
-    writer3->SetInput( output );
-    writer3->Update();
-    */
-
-    CastFilterUintType::Pointer moving_cast_out = castUintImage ( output );
-    output_raw = moving_cast_out->GetOutput();
-    writeRaw( output_raw, i, xsize, ysize, params.reg_name );
-
-    // Write diff
-    if ( params.diff_conf == 4 && params.regmethod != 6){
-      CastFilterUintType::Pointer diff_cast_out = castUintImage ( outdiff );
-      outdiff_raw = diff_cast_out->GetOutput();
-      outdiff_raw->Update();
-      writeRaw( outdiff_raw, i, xsize, ysize, params.diff_name );
+  };
+
+  // The first error of a frame worker is rethrown once all have stopped
+  mutex failLock;
+  exception_ptr failure;
+  auto guardedWorker = [&]( int w ){
+    try {
+      frameWorker( w );
+    } catch ( ... ){
+      lock_guard<mutex> lock( failLock );
+      if ( !failure ){
+        failure = current_exception();
+      }
     }
+  };
 
-    cout << "Done with " << i << " of " << argc-1 << endl;
+  cout << "Registering " << argc - 2 << " frames on " << frameWorkers << " frame workers" << endl;
+  vector<thread> threads;
+  for ( int w=1; w < frameWorkers; w++ ){
+    threads.push_back( thread( guardedWorker, w ) );
+  }
+  guardedWorker( 0 );
+  for ( size_t w=0; w < threads.size(); w++ ){
+    threads[w].join();
+  }
+  if ( failure ){
+    rethrow_exception( failure );
   }
 }
 
 // Creating itk image container
-// Unsigned short
-UintImageType::Pointer rawContainer(
-                                int xsize,
-                                int ysize ){
-
-  UintImageType::RegionType region;
-  UintImageType::IndexType  start;
-
-  start[0] = 0;
-  start[1] = 0;
-
-  UintImageType::SizeType   size;
-  size[0] = xsize;
-  size[1] = ysize;
-
-  region.SetSize(size);
-  region.SetIndex(start);
-
-  UintImageType::Pointer uintType = UintImageType::New();
-  uintType->SetRegions(region);
-  uintType->Allocate();
-
-  return uintType;
-}
-
 // Float
 ImageType::Pointer imgContainer(
                                 int xsize,
@@ -281,46 +193,66 @@ ImageType::Pointer imgContainer(
   return container;
 }
 
-// Reading to itk image container
-UintImageType::Pointer readRaw( UintImageType* const itkraw,
-                                int i,
-                                int xsize,
-                                int ysize,
+// Frame geometry. A .hdr next to the first frame takes precedence over params.conf
+struct hyspex_header rawHeader( struct reg_params params,
                                 char *argv ){
 
-  cout << "In: " << argv << endl;
+  struct hyspex_header header;
+  hyperspectral_err_t errcode = hyperspectral_read_header( argv, &header );
+  if ( errcode == HYPERSPECTRAL_NO_ERR ){
+    cout << "Frame geometry from the header of " << argv << endl;
+    if ( header.bands != 1 ){
+      throw runtime_error( "raw frames must have a single band" );
+    }
+  } else {
+    header.samples    = params.raw_width;
+    header.lines      = params.raw_height;
+    header.bands      = 1;
+    header.offset     = params.raw_skip;
+    header.datatype   = params.raw_datatype;
+    header.byte_order = hyperspectral_host_byte_order();
+  }
+  // A frame is a single band, so any interleave gives the same layout
+  header.interleave   = BSQ_INTERLEAVE;
 
-  // Open images
-  FILE *fid = fopen(argv, "rb");
-  if (fid == NULL){
-    perror(argv);
-    exit(EXIT_FAILURE);
+  if ( hyperspectral_datatype_bytes( header.datatype ) == 0 ){
+    throw runtime_error( "unsupported raw datatype " + to_string( header.datatype ) );
   }
+  cout  << "Frames: "
+        << header.samples << "x" << header.lines
+        << ", datatype " << header.datatype
+        << ", header " << header.offset << " bytes"
+        << endl;
+  return header;
+}
 
-  unsigned short *in_data = new unsigned short[xsize*ysize]();
-  int read_bytes = fread(in_data, sizeof(uint16_t), xsize*ysize, fid);
+// Reading to itk image container
+// The frame is memory-mapped and converted straight into the image buffer
+ImageType::Pointer readRaw(     ImageType* const itkimg,
+                                struct hyspex_header header,
+                                char *argv ){
 
-  // One pixel at a time
-  for ( int j=0; j<ysize; j++){
-    for (int k=0; k<xsize; k++){
-      UintImageType::IndexType pixelIndex;
-      pixelIndex[0] = k;
-      pixelIndex[1] = j;
-      itkraw->SetPixel(pixelIndex, in_data[xsize*j + k]);
-    }
+  struct hyperspectral_mmap frame;
+  hyperspectral_err_t errcode = hyperspectral_mmap_image( argv, &header, &frame );
+  if ( errcode != HYPERSPECTRAL_NO_ERR ){
+    throw runtime_error( string( "could not read " ) + argv );
   }
 
-  fclose( fid );
-  delete [] in_data;
-  return itkraw;
+  hyperspectral_band_to_float( hyperspectral_mmap_band( &frame, 0 ),
+                               itkimg->GetBufferPointer(), header.samples );
+  itkimg->Modified();
+
+  hyperspectral_unmap_image( &frame );
+  return itkimg;
 }
 
 // Writing from itk image container
-void writeRaw(  UintImageType* itkimg,
+// Written in the datatype of the input frames, integers rounded and clamped
+void writeRaw(  ImageType* const itkimg,
                 int i,
-                int xsize,
-                int ysize,
-                string name ){
+                struct hyspex_header header,
+                string name,
+                ostream &log ){
 
   // Recursive names
   name += to_string(i);
@@ -330,24 +262,12 @@ void writeRaw(  UintImageType* itkimg,
 
   // Prepare
   fstream fid (name.c_str(), ios::out | ios::binary);
-  unsigned short *out_data = new unsigned short[xsize*ysize]();
-  size_t size = sizeof(unsigned short) * (xsize*ysize);
-
-  // One pixel at a time
-  for ( int j=0; j<ysize; j++){
-    for ( int k=0; k<xsize; k++){
-      UintImageType::IndexType pixelIndex;
-      pixelIndex[0] = k;
-      pixelIndex[1] = j;
-      out_data[xsize*j + k] = itkimg->GetPixel(pixelIndex);
-    }
-  }
+  size_t pixels = (size_t)header.samples*header.lines;
+  vector<char> raw( pixels*hyperspectral_datatype_bytes( header.datatype ) );
+  hyperspectral_float_to_datatype( itkimg->GetBufferPointer(), pixels, header.datatype, &raw[0] );
 
-  cout << "Out: " << name << endl;
-  // Write
-  fid.write (reinterpret_cast<char*>(out_data), size);
-  // Clean
-  delete [] out_data;
+  log << "Out: " << name << endl;
+  fid.write (&raw[0], raw.size());
   fid.close();
 
 }
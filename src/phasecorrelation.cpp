@@ -0,0 +1,163 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "phasecorrelation.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+using namespace std;
+
+void fft( complex<float> *data, size_t n, size_t stride, bool inverse ){
+
+  // Bit reversal permutation
+  for ( size_t i=1, j=0; i < n; i++ ){
+    size_t bit = n >> 1;
+    for ( ; j & bit; bit >>= 1 ){
+      j ^= bit;
+    }
+    j ^= bit;
+    if ( i < j ){
+      swap( data[i*stride], data[j*stride] );
+    }
+  }
+
+  // Butterflies, twiddle factors in double to keep long transforms accurate
+  for ( size_t length=2; length <= n; length <<= 1 ){
+    double angle = 2.0*M_PI/length*( inverse ? 1.0 : -1.0 );
+    complex<double> step( cos( angle ), sin( angle ) );
+    for ( size_t first=0; first < n; first += length ){
+      complex<double> twiddle( 1.0, 0.0 );
+      for ( size_t k=0; k < length/2; k++ ){
+        complex<float> &a = data[( first + k )*stride];
+        complex<float> &b = data[( first + k + length/2 )*stride];
+        complex<float> t = b*complex<float>( twiddle );
+        b = a - t;
+        a = a + t;
+        twiddle *= step;
+      }
+    }
+  }
+}
+
+// Smallest power of two not below n
+static size_t powerOfTwo( size_t n ){
+  size_t p = 1;
+  while ( p < n ){
+    p <<= 1;
+  }
+  return p;
+}
+
+// 2D FFT of a rows x cols grid, rows first. Columns are copied out in
+// blocks, so that the column passes run on contiguous memory
+static void fft2( vector< complex<float> > &grid, size_t rows, size_t cols, bool inverse ){
+  for ( size_t r=0; r < rows; r++ ){
+    fft( &grid[r*cols], cols, 1, inverse );
+  }
+  const size_t block = min( cols, (size_t)16 );
+  vector< complex<float> > columns( block*rows );
+  for ( size_t c0=0; c0 < cols; c0 += block ){
+    for ( size_t r=0; r < rows; r++ ){
+      for ( size_t c=0; c < block; c++ ){
+        columns[c*rows + r] = grid[r*cols + c0 + c];
+      }
+    }
+    for ( size_t c=0; c < block; c++ ){
+      fft( &columns[c*rows], rows, 1, inverse );
+    }
+    for ( size_t r=0; r < rows; r++ ){
+      for ( size_t c=0; c < block; c++ ){
+        grid[r*cols + c0 + c] = columns[c*rows + r];
+      }
+    }
+  }
+}
+
+// Centered window of a band, mean removed and tapered with a Hann window
+// so that the band edges do not show up as a peak at zero shift
+static void windowBand( const float *band, int width,
+                        int x0, int y0, int w, int h,
+                        vector< complex<float> > &grid, size_t cols ){
+  double mean = 0.0;
+  for ( int y=0; y < h; y++ ){
+    for ( int x=0; x < w; x++ ){
+      mean += band[(size_t)( y0 + y )*width + x0 + x];
+    }
+  }
+  mean /= (double)w*h;
+  for ( int y=0; y < h; y++ ){
+    double wy = 0.5 - 0.5*cos( 2.0*M_PI*( y + 0.5 )/h );
+    for ( int x=0; x < w; x++ ){
+      double wx = 0.5 - 0.5*cos( 2.0*M_PI*( x + 0.5 )/w );
+      grid[(size_t)y*cols + x] = complex<float>(
+        ( band[(size_t)( y0 + y )*width + x0 + x] - mean )*wx*wy, 0.0 );
+    }
+  }
+}
+
+// Offset of the true peak from sample b, given its neighbours a and c.
+// The peak of phase correlation is a sampled sinc, so the neighbour on
+// the side of the true peak carries the fraction (Foroosh et al. 2002)
+static double subpixelPeak( double a, double b, double c ){
+  if ( b <= 0.0 ){
+    return 0.0;
+  }
+  if ( c > a ){
+    return c > 0.0 ? c/( c + b ) : 0.0;
+  }
+  return a > 0.0 ? -a/( a + b ) : 0.0;
+}
+
+double phaseCorrelation( const float *fixed,
+                         const float *moving,
+                         int width,
+                         int height,
+                         double shift[2],
+                         int window ){
+
+  int w  = min( width,  window );
+  int h  = min( height, window );
+  int x0 = ( width  - w )/2;
+  int y0 = ( height - h )/2;
+  size_t cols = powerOfTwo( w );
+  size_t rows = powerOfTwo( h );
+
+  // Zero padding up to the next power of two
+  vector< complex<float> > f( rows*cols ), m( rows*cols );
+  windowBand( fixed,  width, x0, y0, w, h, f, cols );
+  windowBand( moving, width, x0, y0, w, h, m, cols );
+  fft2( f, rows, cols, false );
+  fft2( m, rows, cols, false );
+
+  // Normalized cross power spectrum, its inverse peaks at the shift
+  for ( size_t n=0; n < f.size(); n++ ){
+    complex<float> cross = m[n]*conj( f[n] );
+    float magnitude = abs( cross );
+    f[n] = magnitude > 0.0f ? cross/magnitude : complex<float>( 0.0, 0.0 );
+  }
+  fft2( f, rows, cols, true );
+
+  size_t best = 0;
+  for ( size_t n=1; n < f.size(); n++ ){
+    if ( f[n].real() > f[best].real() ){
+      best = n;
+    }
+  }
+  size_t py = best / cols;
+  size_t px = best % cols;
+  auto value = [&]( size_t y, size_t x ) -> double {
+    return f[( ( y + rows ) % rows )*cols + ( x + cols ) % cols].real();
+  };
+  double peak = value( py, px );
+  double dx = subpixelPeak( value( py, px + cols - 1 ), peak, value( py, px + 1 ) );
+  double dy = subpixelPeak( value( py + rows - 1, px ), peak, value( py + 1, px ) );
+
+  // Shifts past half the window wrap around to negative shifts
+  shift[0] = ( px > cols/2 ? (double)px - cols : (double)px ) + dx;
+  shift[1] = ( py > rows/2 ? (double)py - rows : (double)py ) + dy;
+  return peak/( rows*cols );
+}
@@ -6,6 +6,10 @@
 //=======================================================================================================
 
 #include "readimage.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 using namespace std;
 
 const int MAX_CHAR = 512;
@@ -51,6 +55,7 @@ hyperspectral_err_t hyperspectral_read_header(const char* filename, struct hyspe
 	string hdrOffset = getValue(hdrText, "header offset");
 	string interleave = getValue(hdrText, "interleave");
 	string datatype = getValue(hdrText, "data type");
+	string byteOrder = getValue(hdrText, "byte order");
   //
   //cerr << samples.empty() << endl;
   //cerr << bands.empty() << endl;
@@ -71,16 +76,24 @@ hyperspectral_err_t hyperspectral_read_header(const char* filename, struct hyspe
 	header->wlens = getWavelengths(header->bands, wavelengths);
 	header->datatype = strtod(datatype.c_str(), NULL);
 
+	//byte order is optional, files without it are assumed to be little endian
+	header->byte_order = 0;
+	if (!byteOrder.empty()){
+		header->byte_order = strtod(byteOrder.c_str(), NULL);
+	}
+
 	if (interleave == "bil"){
 		header->interleave = BIL_INTERLEAVE;
 	} else if (interleave == "bip"){
 		header->interleave = BIP_INTERLEAVE;
+	} else if (interleave == "bsq"){
+		header->interleave = BSQ_INTERLEAVE;
 	} else {
 		return HYPERSPECTRAL_INTERLEAVE_UNSUPPORTED;
 	}
 
 	//recap
-	fprintf(stderr, "Extracted: lines=%d, samples=%d, bands=%d, offset=%d, data type=%d\n", header->lines, header->samples, header->bands, header->offset, header->datatype);
+	fprintf(stderr, "Extracted: lines=%d, samples=%d, bands=%d, offset=%d, data type=%d, byte order=%d\n", header->lines, header->samples, header->bands, header->offset, header->datatype, header->byte_order);
 	fprintf(stderr, "Wavelengths: ");
 	for (int i=0; i < header->wlens.size(); i++){
 		fprintf(stderr, "%f ", header->wlens[i]);
@@ -103,70 +116,207 @@ hyperspectral_err_t hyperspectral_read_image(const char *filename, struct hyspex
 
 
 hyperspectral_err_t hyperspectral_read_image(const char *filename, struct hyspex_header *header, struct image_subset subset, float *data){
+	struct hyperspectral_mmap image;
+	hyperspectral_err_t errcode = hyperspectral_mmap_image(filename, header, subset, &image);
+	if (errcode != HYPERSPECTRAL_NO_ERR){
+		return errcode;
+	}
+
+	//convert band by band into the BIL ordered output array
+	int numBands = subset.end_band - subset.start_band;
+	int numSamples = subset.end_sample - subset.start_sample;
+	for (int k=0; k < numBands; k++){
+		hyperspectral_band_to_float(hyperspectral_mmap_band(&image, k), data + k*numSamples, numBands*numSamples);
+	}
+
+	hyperspectral_unmap_image(&image);
+	return HYPERSPECTRAL_NO_ERR;
+}
+
+hyperspectral_err_t hyperspectral_mmap_image(const char *filename, struct hyspex_header *header, struct hyperspectral_mmap *image){
+	struct image_subset subset;
+	subset.start_sample = 0;
+	subset.end_sample = header->samples;
+	subset.start_line = 0;
+	subset.end_line = header->lines;
+	subset.start_band = 0;
+	subset.end_band = header->bands;
+
+	return hyperspectral_mmap_image(filename, header, subset, image);
+}
+
+hyperspectral_err_t hyperspectral_mmap_image(const char *filename, struct hyspex_header *header, struct image_subset subset, struct hyperspectral_mmap *image){
 	//find number of bytes for contained element
-  size_t elementBytes = 0;
-	if (header->datatype == 4){
-		elementBytes = sizeof(float);
-	} else if (header->datatype == 12){
-		elementBytes = sizeof(uint16_t);
-	} else if (header->datatype == 2){
-		elementBytes = sizeof(int16_t);
-	} else {
+	size_t elementBytes = hyperspectral_datatype_bytes(header->datatype);
+	if (elementBytes == 0){
 		return HYPERSPECTRAL_DATATYPE_UNSUPPORTED;
 	}
 
-  FILE *fp = fopen(filename, "rb");
-  if (fp == NULL){
-    return HYPERSPECTRAL_FILE_NOT_FOUND;
-  }
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0){
+		return HYPERSPECTRAL_FILE_NOT_FOUND;
+	}
+
+	//map everything up to the last line we want, or the last band we want for BSQ.
+	//the file offset of a mapping has to be page aligned, so the header is mapped as well
+	size_t lineBytes = (size_t)header->samples*header->bands*elementBytes;
+	size_t mapLength = (size_t)header->offset + subset.end_line*lineBytes;
+	if (header->interleave == BSQ_INTERLEAVE){
+		mapLength = (size_t)header->offset + (size_t)subset.end_band*header->lines*header->samples*elementBytes;
+	}
+	struct stat fileStat;
+	if ((fstat(fd, &fileStat) != 0) || ((size_t)fileStat.st_size < mapLength) || (mapLength == 0)){
+		close(fd);
+		return HYPERSPECTRAL_FILE_READING_ERROR;
+	}
+	//read-only mapping, so that a large cube is backed by the file and not by swap. Bands handed out in place must
+	//never be written to
+	void *map = mmap(NULL, mapLength, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED){
+		return HYPERSPECTRAL_FILE_READING_ERROR;
+	}
+
+	image->header = *header;
+	image->subset = subset;
+	image->map = map;
+	image->map_length = mapLength;
+	image->data = (const char*)map + header->offset;
+	image->element_bytes = elementBytes;
+	return HYPERSPECTRAL_NO_ERR;
+}
 
-  //skip header and lines we do not want
-  size_t skipBytes = subset.start_line*header->samples*header->bands*elementBytes + header->offset;
-  fprintf(stderr, "skipBytes: %d\n", skipBytes);
-  fseek(fp, skipBytes, SEEK_SET);
+void hyperspectral_unmap_image(struct hyperspectral_mmap *image){
+	if (image->map != NULL){
+		munmap(image->map, image->map_length);
+	}
+	image->map = NULL;
+	image->data = NULL;
+}
 
-  int numLinesToRead = subset.end_line - subset.start_line;
+const char *hyperspectral_mmap_line(const struct hyperspectral_mmap *image, int line){
+	size_t lineBytes = (size_t)image->header.samples*image->header.bands*image->element_bytes;
+	if (image->header.interleave == BSQ_INTERLEAVE){
+		lineBytes = (size_t)image->header.samples*image->element_bytes;
+	}
+	return image->data + (size_t)(image->subset.start_line + line)*lineBytes;
+}
 
+struct hyperspectral_band_view hyperspectral_mmap_band(const struct hyperspectral_mmap *image, int band){
+	const struct hyspex_header *header = &(image->header);
+	int k = image->subset.start_band + band;
+
+	struct hyperspectral_band_view view;
+	view.samples = image->subset.end_sample - image->subset.start_sample;
+	view.lines = image->subset.end_line - image->subset.start_line;
+	view.datatype = header->datatype;
+	view.byte_swap = (header->byte_order != hyperspectral_host_byte_order());
+	view.line_stride = (size_t)header->samples*header->bands*image->element_bytes;
+
+	size_t bandOffset = 0;
+	switch (header->interleave){
+		case BIL_INTERLEAVE:
+			view.sample_stride = image->element_bytes;
+			bandOffset = (size_t)k*header->samples*image->element_bytes;
+		break;
+
+		case BIP_INTERLEAVE:
+			view.sample_stride = header->bands*image->element_bytes;
+			bandOffset = k*image->element_bytes;
+		break;
+
+		case BSQ_INTERLEAVE:
+			view.line_stride = (size_t)header->samples*image->element_bytes;
+			view.sample_stride = image->element_bytes;
+			bandOffset = (size_t)k*header->lines*header->samples*image->element_bytes;
+		break;
+	}
+	view.data = hyperspectral_mmap_line(image, 0) + bandOffset + image->subset.start_sample*view.sample_stride;
+	return view;
+}
 
-  //read in line by line
-  for (int i=0; i < numLinesToRead; i++){
-    char *line = (char*)malloc(elementBytes*header->bands*header->samples);
-    int sizeRead = fread(line, elementBytes, header->bands*header->samples, fp);
-    if (sizeRead == 0){
-			return HYPERSPECTRAL_FILE_READING_ERROR;
-		}
+float *hyperspectral_band_slice(struct hyperspectral_band_view view){
+	if ((view.datatype == 4) && !view.byte_swap && (view.sample_stride == sizeof(float)) && (view.line_stride == sizeof(float)*view.samples)){
+		return (float*)view.data;
+	}
+	return NULL;
+}
 
-		//convert to float, copy to total array
-		for (int k=subset.start_band; k < subset.end_band; k++){
-			for (int j=subset.start_sample; j < subset.end_sample; j++){
-				float val;
-				int position = 0;
-				switch (header->interleave){
-					case BIL_INTERLEAVE:
-						position = k*header->samples + j;
-					break;
-
-					case BIP_INTERLEAVE:
-						position = j*header->bands + k;
-					break;
-				}
-				if (header->datatype == 4){
-					val = ((float*)line)[position];
-				} else if (header->datatype == 12){
-					val = (((uint16_t*)line)[position])*1.0f;
-				} else if (header->datatype == 2){
-					val = (((int16_t*)line)[position])*1.0f;
-				}
-				data[i*(subset.end_band - subset.start_band)*(subset.end_sample - subset.start_sample) + (k - subset.start_band)*(subset.end_sample - subset.start_sample) + j-subset.start_sample] = val;
-			}
+//convert one line of a band view, the datatype switch is kept outside of the inner loops
+template<typename T>
+static void convert_line(const char *src, size_t sample_stride, int samples, float *dst){
+	if (sample_stride == sizeof(T)){
+		const T *line = (const T*)src;
+		for (int j=0; j < samples; j++){
+			dst[j] = line[j];
+		}
+	} else {
+		for (int j=0; j < samples; j++){
+			dst[j] = *((const T*)(src + j*sample_stride));
 		}
-		free(line);
+	}
+}
 
+//byte swaps written with shifts and masks, which vectorize
+static inline uint16_t swap_bytes(uint16_t val){
+	return (uint16_t)((val >> 8) | (val << 8));
+}
 
+static inline uint32_t swap_bytes(uint32_t val){
+	return (val >> 24) | ((val >> 8) & 0x0000ff00u) | ((val << 8) & 0x00ff0000u) | (val << 24);
+}
 
+//convert one line of a band view stored in the opposite byte order. The swap is fused with the conversion, U is the
+//unsigned integer type of the same size as T
+template<typename T, typename U>
+static void convert_line_swapped(const char *src, size_t sample_stride, int samples, float *dst){
+	if (sample_stride == sizeof(T)){
+		const U *line = (const U*)src;
+		for (int j=0; j < samples; j++){
+			U raw = swap_bytes(line[j]);
+			T val;
+			memcpy(&val, &raw, sizeof(T));
+			dst[j] = val;
+		}
+	} else {
+		for (int j=0; j < samples; j++){
+			U raw = swap_bytes(*((const U*)(src + j*sample_stride)));
+			T val;
+			memcpy(&val, &raw, sizeof(T));
+			dst[j] = val;
+		}
+	}
+}
+
+int hyperspectral_host_byte_order(){
+	const uint16_t probe = 1;
+	return (*((const char*)&probe) == 1) ? 0 : 1;
+}
+
+void hyperspectral_band_to_float(struct hyperspectral_band_view view, float *data, size_t line_stride){
+	for (int i=0; i < view.lines; i++){
+		const char *src = view.data + i*view.line_stride;
+		float *dst = data + i*line_stride;
+		if (view.datatype == 1){
+			convert_line<uint8_t>(src, view.sample_stride, view.samples, dst);
+		} else if (view.byte_swap){
+			if (view.datatype == 4){
+				convert_line_swapped<float, uint32_t>(src, view.sample_stride, view.samples, dst);
+			} else if (view.datatype == 12){
+				convert_line_swapped<uint16_t, uint16_t>(src, view.sample_stride, view.samples, dst);
+			} else if (view.datatype == 2){
+				convert_line_swapped<int16_t, uint16_t>(src, view.sample_stride, view.samples, dst);
+			}
+		} else if ((view.datatype == 4) && (view.sample_stride == sizeof(float))){
+			memcpy(dst, src, sizeof(float)*view.samples);
+		} else if (view.datatype == 4){
+			convert_line<float>(src, view.sample_stride, view.samples, dst);
+		} else if (view.datatype == 12){
+			convert_line<uint16_t>(src, view.sample_stride, view.samples, dst);
+		} else if (view.datatype == 2){
+			convert_line<int16_t>(src, view.sample_stride, view.samples, dst);
+		}
 	}
-	fclose(fp);
-	return HYPERSPECTRAL_NO_ERR;
 }
 
 string getMatch(string input_string, regmatch_t *matchArray, int matchNum){
@@ -191,7 +341,7 @@ string getValue(string hdrText, string property){
 		fprintf(stderr, "Could not find parameter in file: %s\n", property.c_str());
 		regfree(&propertyMatch);
 		free(matchArray);
-		return NULL;
+		return "";
 	}
 	string retVal = getMatch(hdrText, matchArray, 1);
 
@@ -271,7 +421,7 @@ vector<float> getWavelengths(int bands, string wavelengthStr){
 #include <sstream>
 using namespace std;
 
-void hyperspectral_write_header(const char *filename, int numBands, int numPixels, int numLines, std::vector<float> wlens){
+void hyperspectral_write_header(const char *filename, int numBands, int numPixels, int numLines, std::vector<float> wlens, interleave_t interleave, int datatype){
 	//write image header
 	ostringstream hdrFname;
 	hdrFname << filename << ".hdr";
@@ -282,10 +432,14 @@ void hyperspectral_write_header(const char *filename, int numBands, int numPixel
 	hdrOut << "bands = " << numBands << endl;
 	hdrOut << "header offset = 0" << endl;
 	hdrOut << "file type = ENVI Standard" << endl;
-	hdrOut << "data type = 4" << endl;
-	hdrOut << "interleave = bil" << endl;
+	hdrOut << "data type = " << datatype << endl;
+	if (interleave == BSQ_INTERLEAVE){
+		hdrOut << "interleave = bsq" << endl;
+	} else {
+		hdrOut << "interleave = bil" << endl;
+	}
 	hdrOut << "default bands = {55,41,12}" << endl;
-	hdrOut << "byte order = 0" << endl;
+	hdrOut << "byte order = " << hyperspectral_host_byte_order() << endl;
 	hdrOut << "wavelength = {";
 	for (int i=0; i < wlens.size(); i++){
 		hdrOut << wlens[i] << " ";
@@ -294,20 +448,150 @@ void hyperspectral_write_header(const char *filename, int numBands, int numPixel
 	hdrOut.close();
 }
 
-void hyperspectral_write_image(const char *filename, int numBands, int numPixels, int numLines, float *data){
+size_t hyperspectral_datatype_bytes(int datatype){
+	if (datatype == 4){
+		return sizeof(float);
+	} else if (datatype == 12){
+		return sizeof(uint16_t);
+	} else if (datatype == 2){
+		return sizeof(int16_t);
+	} else if (datatype == 1){
+		return sizeof(uint8_t);
+	}
+	return 0;
+}
+
+//round to nearest and clamp to [lo, hi]. Written with selects only, so that the loop vectorizes. NaN ends up at lo.
+template<typename T>
+static void round_clamp(const float *src, size_t numElements, float lo, float hi, T *dst){
+	for (size_t j=0; j < numElements; j++){
+		float val = src[j] + copysignf(0.5f, src[j]);
+		val = (val > lo) ? val : lo;
+		val = (val < hi) ? val : hi;
+		dst[j] = (T)((int32_t)val);
+	}
+}
+
+void hyperspectral_float_to_datatype(const float *src, size_t numElements, int datatype, char *dst){
+	if (datatype == 12){
+		round_clamp<uint16_t>(src, numElements, 0.0f, 65535.0f, (uint16_t*)dst);
+	} else if (datatype == 2){
+		round_clamp<int16_t>(src, numElements, -32768.0f, 32767.0f, (int16_t*)dst);
+	} else if (datatype == 1){
+		round_clamp<uint8_t>(src, numElements, 0.0f, 255.0f, (uint8_t*)dst);
+	} else {
+		memcpy(dst, src, sizeof(float)*numElements);
+	}
+}
+
+void hyperspectral_write_image(const char *filename, int numBands, int numPixels, int numLines, float *data, interleave_t interleave, int datatype){
 	//prepare image file
 	ostringstream imgFname;
 	imgFname << filename << ".img";
 	ofstream *hyspexOut = new ofstream(imgFname.str().c_str(),ios::out | ios::binary);
+	size_t elementBytes = hyperspectral_datatype_bytes(datatype);
 
 	//write image
-	for (int i=0; i < numLines; i++){
-		float *write_data = data + i*numBands*numPixels;
-		hyspexOut->write((char*)(write_data), sizeof(float)*numBands*numPixels);
+	if (interleave == BSQ_INTERLEAVE){
+		//gather one band at a time from the BIL ordered data, and write it in one go
+		char *band = new char[(size_t)numPixels*numLines*elementBytes];
+		for (int k=0; k < numBands; k++){
+			for (int i=0; i < numLines; i++){
+				hyperspectral_float_to_datatype(data + (size_t)i*numBands*numPixels + (size_t)k*numPixels, numPixels, datatype, band + (size_t)i*numPixels*elementBytes);
+			}
+			hyspexOut->write(band, elementBytes*numPixels*numLines);
+		}
+		delete [] band;
+	} else {
+		char *line = new char[(size_t)numBands*numPixels*elementBytes];
+		for (int i=0; i < numLines; i++){
+			float *write_data = data + (size_t)i*numBands*numPixels;
+			hyperspectral_float_to_datatype(write_data, (size_t)numBands*numPixels, datatype, line);
+			hyspexOut->write(line, elementBytes*numBands*numPixels);
+		}
+		delete [] line;
 	}
 
 	hyspexOut->close();
 	delete hyspexOut;
 }
 
+hyperspectral_err_t hyperspectral_create_image(const char *filename, int numBands, int numPixels, int numLines, interleave_t interleave, int datatype, struct hyperspectral_writer *writer){
+	size_t elementBytes = hyperspectral_datatype_bytes(datatype);
+	if (elementBytes == 0){
+		return HYPERSPECTRAL_DATATYPE_UNSUPPORTED;
+	}
 
+	ostringstream imgFname;
+	imgFname << filename << ".img";
+	int fd = open(imgFname.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0){
+		return HYPERSPECTRAL_FILE_NOT_FOUND;
+	}
+	//preallocate the whole file, so that band writes never have to extend it
+	off_t imageBytes = (off_t)elementBytes*numBands*numPixels*numLines;
+	if ((posix_fallocate(fd, 0, imageBytes) != 0) && (ftruncate(fd, imageBytes) != 0)){
+		close(fd);
+		return HYPERSPECTRAL_FILE_READING_ERROR;
+	}
+
+	writer->fd = fd;
+	writer->bands = numBands;
+	writer->samples = numPixels;
+	writer->lines = numLines;
+	writer->interleave = interleave;
+	writer->datatype = datatype;
+	return HYPERSPECTRAL_NO_ERR;
+}
+
+//pwrite until everything is written
+static bool write_at(int fd, const char *data, size_t size, off_t offset){
+	while (size > 0){
+		ssize_t written = pwrite(fd, data, size, offset);
+		if (written <= 0){
+			return false;
+		}
+		data += written;
+		size -= written;
+		offset += written;
+	}
+	return true;
+}
+
+hyperspectral_err_t hyperspectral_write_band(struct hyperspectral_writer *writer, int band, const float *data){
+	size_t elementBytes = hyperspectral_datatype_bytes(writer->datatype);
+	size_t lineBytes = elementBytes*writer->samples;
+	size_t bandElements = (size_t)writer->samples*writer->lines;
+
+	//float bands are written as they are, integer bands are converted in one pass first
+	const char *bandData = (const char*)data;
+	char *converted = NULL;
+	if (writer->datatype != 4){
+		converted = new char[bandElements*elementBytes];
+		hyperspectral_float_to_datatype(data, bandElements, writer->datatype, converted);
+		bandData = converted;
+	}
+
+	bool success = true;
+	if (writer->interleave == BSQ_INTERLEAVE){
+		off_t offset = (off_t)band*writer->lines*lineBytes;
+		success = write_at(writer->fd, bandData, writer->lines*lineBytes, offset);
+	} else {
+		for (int i=0; (i < writer->lines) && success; i++){
+			off_t offset = ((off_t)i*writer->bands + band)*lineBytes;
+			success = write_at(writer->fd, bandData + i*lineBytes, lineBytes, offset);
+		}
+	}
+	delete [] converted;
+	if (!success){
+		return HYPERSPECTRAL_FILE_READING_ERROR;
+	}
+	return HYPERSPECTRAL_NO_ERR;
+}
+
+void hyperspectral_close_image(struct hyperspectral_writer *writer){
+	if (writer->fd >= 0){
+		close(writer->fd);
+	}
+	writer->fd = -1;
+}
@@ -30,8 +30,19 @@ void CommandIterationUpdate::Execute(const itk::Object * object, const itk::Even
 // Functions for float images
 // ==========================
 
+// Limit a filter to the given number of threads, 0 leaves the itk default
+void setFilterThreads( itk::ProcessObject* const filter, int threads ){
+  if ( threads > 0 ){
+#if ITK_VERSION_MAJOR >= 5
+    filter->SetNumberOfWorkUnits( threads );
+#else
+    filter->SetNumberOfThreads( threads );
+#endif
+  }
+}
+
 // Median filter
-ImageType::Pointer medianFilter( ImageType* const fixed, int radius ){
+ImageType::Pointer medianFilter( ImageType* const fixed, int radius, int threads ){
   MedianFilterType::Pointer median = MedianFilterType::New();
   ImageType::SizeType rad;
 
@@ -40,17 +51,19 @@ ImageType::Pointer medianFilter( ImageType* const fixed, int radius ){
 
   median->SetRadius( 	rad );
   median->SetInput( fixed );
+  setFilterThreads( median, threads );
   median->Update();
 
   return median->GetOutput();
 }
 
 // Gradient filter
-ImageType::Pointer gradientFilter( ImageType* const fixed, int sigma ){
+ImageType::Pointer gradientFilter( ImageType* const fixed, int sigma, int threads ){
   GradientFilterType::Pointer gradient = GradientFilterType::New();
 
   gradient->SetSigma( sigma );
   gradient->SetInput( fixed );
+  setFilterThreads( gradient, threads );
   gradient->Update();
 
   return gradient->GetOutput();
@@ -254,6 +267,8 @@ DifferenceFilterType::Pointer diffFilter(
 
   difference->SetInput1(        moving         );
   difference->SetInput2( resample->GetOutput() );
+  // Never write over moving, which may be a band of a read-only mapping
+  difference->InPlaceOff();
 
   return difference;
 }
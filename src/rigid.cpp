@@ -14,7 +14,9 @@ using namespace std;
 TransformRigidType::Pointer registration1(
                                         ImageType* const fixed,
                                         ImageType* const moving,
-                                        reg_params params ){
+                                        reg_params params,
+                                        TransformRigidType* const initial,
+                                        unsigned *iterations ){
 
   // Optimizer and Registration containers
   OptimizerType::Pointer          optimizer     = OptimizerType::New();
@@ -22,6 +24,7 @@ TransformRigidType::Pointer registration1(
                                         fixed,
                                         moving,
                                         optimizer );
+  setMetricSampling( registration.GetPointer(), params );
 
   // Construction of the transform object
   TransformRigidType::Pointer     transform     = TransformRigidType::New();
@@ -33,16 +36,20 @@ TransformRigidType::Pointer registration1(
   // Set parameters
   transform->SetAngle( params.angle );
 
-  if ( params.translation == 1) {
-    CompositeTransformType::Pointer ttransform = translation(
-                                        fixed,
+  // Warm start from an already solved transform
+  if ( initial != NULL ){
+    transform->SetFixedParameters( initial->GetFixedParameters() );
+    transform->SetParameters( initial->GetParameters() );
+  }
+
+  CompositeTransformType::Pointer ttransform;
+  if ( params.translation >= 1 && initial == NULL ) {
+    ttransform = initialTranslation(    fixed,
                                         moving,
                                         params );
-    registration->SetInitialTransform( transform );
     registration->SetMovingInitialTransform( ttransform );
-  } else {
-    registration->SetInitialTransform( transform );
   }
+  registration->SetInitialTransform( transform );
   registration->InPlaceOn();
 
   OptimizerScalesType optimizerScales( transform->GetNumberOfParameters() );
@@ -81,17 +88,23 @@ TransformRigidType::Pointer registration1(
     cout << "Optimizer stop condition: "
               << registration->GetOptimizer()->GetStopConditionDescription()
               << endl;
+    if ( iterations != NULL ){
+      *iterations = optimizer->GetCurrentIteration();
+    }
   }
   catch( itk::ExceptionObject & err ){
     cerr << "ExceptionObject caught !" << endl;
     cerr << err << endl;
-    exit(1);
+    throw;
   }
 
   // Get final transform
   TransformRigidType::Pointer finalTransform = TransformRigidType::New();
   finalTransform->SetParameters( transform->GetParameters() );
   finalTransform->SetFixedParameters( transform->GetFixedParameters() );
+  if ( ttransform.IsNotNull() ){
+    composeTranslation( finalTransform.GetPointer(), ttransform );
+  }
 
   // Print results
   if ( params.output == 1 ){
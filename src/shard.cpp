@@ -0,0 +1,196 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+#include "shard.h"
+#include <fstream>
+#include <stdexcept>
+#include <vector>
+using namespace std;
+
+// Size of the copy buffer for BSQ merges
+const size_t MERGE_CHUNK = 1 << 22;
+
+struct image_subset shardRange( const reg_params &params,
+                                struct hyspex_header header ){
+  struct image_subset range;
+  range.start_sample = 0;
+  range.end_sample   = header.samples;
+  range.start_line   = 0;
+  range.end_line     = header.lines;
+  range.start_band   = (long)header.bands*params.shard_index/params.shard_count;
+  range.end_band     = (long)header.bands*(params.shard_index + 1)/params.shard_count;
+  return range;
+}
+
+struct hyspex_header shardHeader( struct hyspex_header header,
+                                  struct image_subset range ){
+  header.bands = range.end_band - range.start_band;
+  if ( (int)header.wlens.size() >= range.end_band ){
+    header.wlens = vector<float>( header.wlens.begin() + range.start_band,
+      header.wlens.begin() + range.end_band );
+  }
+  return header;
+}
+
+string shardName( const string &name,
+                  const reg_params &params ){
+  if ( params.shard_count <= 1 ){
+    return name;
+  }
+  return name + "_shard" + to_string( params.shard_index );
+}
+
+void writeShardIndex( const reg_params &params,
+                      struct image_subset range ){
+  if ( params.shard_count <= 1 ){
+    return;
+  }
+  string name = shardName( params.reg_name, params ) + ".idx";
+  ofstream fid( name.c_str() );
+  fid << "shard " << params.shard_index << endl
+      << "shard_count " << params.shard_count << endl
+      << "start_band " << range.start_band << endl
+      << "end_band " << range.end_band << endl;
+  cout << "Wrote shard index " << name << endl;
+}
+
+// Band range of shard k from its index, throws if the index is missing
+static struct image_subset readShardIndex( const reg_params &params,
+                                           int k ){
+  reg_params shard = params;
+  shard.shard_index = k;
+  string name = shardName( params.reg_name, shard ) + ".idx";
+
+  ifstream fid( name.c_str() );
+  string key;
+  int value, index = -1, count = -1;
+  struct image_subset range;
+  range.start_band = range.end_band = -1;
+  while ( fid >> key >> value ){
+    if ( key == "shard" ){
+      index = value;
+    } else if ( key == "shard_count" ){
+      count = value;
+    } else if ( key == "start_band" ){
+      range.start_band = value;
+    } else if ( key == "end_band" ){
+      range.end_band = value;
+    }
+  }
+  if ( index != k || count != params.shard_count || range.start_band < 0 ){
+    throw runtime_error( "missing or unfinished shard " + to_string( k ) + ", see " + name );
+  }
+  return range;
+}
+
+static void closeParts( vector<FILE*> &parts ){
+  for ( size_t k=0; k < parts.size(); k++ ){
+    fclose( parts[k] );
+  }
+  parts.clear();
+}
+
+// Concatenate the partial cubes of one output. BIL partials are interleaved
+// line by line, BSQ partials are appended as they are
+static void mergeCube( const string &name,
+                       const reg_params &params,
+                       const vector<struct image_subset> &ranges,
+                       struct hyspex_header header ){
+
+  vector<FILE*> parts;
+  struct hyspex_header first, part;
+  for ( int k=0; k < params.shard_count; k++ ){
+    reg_params shard = params;
+    shard.shard_index = k;
+    string partName = shardName( name, shard ) + ".img";
+
+    hyperspectral_err_t errcode = hyperspectral_read_header( partName.c_str(), &part );
+    FILE *fid = fopen( partName.c_str(), "rb" );
+    if ( fid != NULL ){
+      parts.push_back( fid );
+    }
+    if ( errcode != HYPERSPECTRAL_NO_ERR || fid == NULL
+        || part.bands != ranges[k].end_band - ranges[k].start_band
+        || part.samples != header.samples || part.lines != header.lines ){
+      closeParts( parts );
+      throw runtime_error( "could not read partial cube " + partName );
+    }
+    // The parts are concatenated as raw bytes, so they must all be laid
+    // out alike. A shard run with other settings is caught here
+    if ( k == 0 ){
+      first = part;
+    } else if ( part.interleave != first.interleave || part.datatype != first.datatype
+        || part.byte_order != first.byte_order ){
+      closeParts( parts );
+      throw runtime_error( "partial cube " + partName + " is stored differently from shard 0"
+                           " (interleave, datatype or byte order)" );
+    }
+  }
+
+  size_t elementBytes = hyperspectral_datatype_bytes( part.datatype );
+  hyperspectral_write_header( name.c_str(), header.bands, header.samples,
+    header.lines, header.wlens, part.interleave, part.datatype );
+  string outName = name + ".img";
+  FILE *out = fopen( outName.c_str(), "wb" );
+  if ( out == NULL ){
+    closeParts( parts );
+    throw runtime_error( "could not create " + outName );
+  }
+
+  bool ok = true;
+  if ( part.interleave == BSQ_INTERLEAVE ){
+    vector<char> buffer( MERGE_CHUNK );
+    for ( size_t k=0; k < parts.size(); k++ ){
+      size_t n;
+      while ( (n = fread( &buffer[0], 1, buffer.size(), parts[k] )) > 0 ){
+        ok = ok && ( fwrite( &buffer[0], 1, n, out ) == n );
+      }
+    }
+  } else {
+    vector<char> line( (size_t)header.bands*header.samples*elementBytes );
+    for ( int l=0; l < header.lines; l++ ){
+      for ( size_t k=0; k < parts.size(); k++ ){
+        size_t n = (size_t)(ranges[k].end_band - ranges[k].start_band)*header.samples*elementBytes;
+        ok = ok && ( fread( &line[0], 1, n, parts[k] ) == n );
+        ok = ok && ( fwrite( &line[0], 1, n, out ) == n );
+      }
+    }
+  }
+
+  size_t merged = parts.size();
+  closeParts( parts );
+  if ( fclose( out ) != 0 || !ok ){
+    throw runtime_error( "could not merge " + outName );
+  }
+  cout << "Merged " << merged << " shards into " << outName << endl;
+}
+
+void hyperspec_merge( struct hyspex_header header,
+                      reg_params params ){
+  if ( params.shard_count <= 1 ){
+    throw runtime_error( "merging needs shard_count > 1" );
+  }
+
+  // Shards must cover all bands, in order
+  vector<struct image_subset> ranges;
+  int next = 0;
+  for ( int k=0; k < params.shard_count; k++ ){
+    ranges.push_back( readShardIndex( params, k ) );
+    if ( ranges[k].start_band != next ){
+      throw runtime_error( "shard " + to_string( k ) + " does not start at band " + to_string( next ) );
+    }
+    next = ranges[k].end_band;
+  }
+  if ( next != header.bands ){
+    throw runtime_error( "shards end at band " + to_string( next ) + " of " + to_string( header.bands ) );
+  }
+
+  mergeCube( params.reg_name, params, ranges, header );
+  if ( diffOutputName( params ) != NULL ){
+    mergeCube( params.diff_name, params, ranges, header );
+  }
+}
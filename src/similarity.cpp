@@ -13,7 +13,9 @@
 TransformSimilarityType::Pointer registration2(
                                         ImageType* const fixed,
                                         ImageType* const moving,
-                                        reg_params params ){
+                                        reg_params params,
+                                        TransformSimilarityType* const initial,
+                                        unsigned *iterations ){
 
   // Optimizer and Registration containers
   OptimizerType::Pointer    optimizer     = OptimizerType::New();
@@ -21,6 +23,7 @@ TransformSimilarityType::Pointer registration2(
                                         fixed,
                                         moving,
                                         optimizer );
+  setMetricSampling( registration.GetPointer(), params );
 
   // Construction of the transform object
   TransformSimilarityType::Pointer    transform     = TransformSimilarityType::New();
@@ -33,15 +36,20 @@ TransformSimilarityType::Pointer registration2(
   transform->SetScale( params.scale );
   transform->SetAngle( params.angle );
 
-  if (params.translation == 1 ){
-    CompositeTransformType::Pointer ttransform = translation(
-                                        fixed,
+  // Warm start from an already solved transform
+  if ( initial != NULL ){
+    transform->SetFixedParameters( initial->GetFixedParameters() );
+    transform->SetParameters( initial->GetParameters() );
+  }
+
+  CompositeTransformType::Pointer ttransform;
+  if ( params.translation >= 1 && initial == NULL ){
+    ttransform = initialTranslation(    fixed,
                                         moving,
                                         params );
     registration->SetMovingInitialTransform( ttransform );
-  } else {
-    registration->SetInitialTransform( transform );
   }
+  registration->SetInitialTransform( transform );
   registration->InPlaceOn();
 
   OptimizerScalesType optimizerScales( transform->GetNumberOfParameters() );
@@ -79,11 +87,19 @@ TransformSimilarityType::Pointer registration2(
     std::cout << "Optimizer stop condition: "
               << registration->GetOptimizer()->GetStopConditionDescription()
               << std::endl;
+    if ( iterations != NULL ){
+      *iterations = optimizer->GetCurrentIteration();
+    }
   }
   catch( itk::ExceptionObject & err ){
     std::cerr << "ExceptionObject caught !" << std::endl;
     std::cerr << err << std::endl;
-    exit(1);
+    throw;
+  }
+
+  // The returned transform includes the initial translation
+  if ( ttransform.IsNotNull() ){
+    composeTranslation( transform.GetPointer(), ttransform );
   }
 
   // Resample new image
@@ -6,6 +6,7 @@
 // =========================================================================
 
 #include "registration.h"
+#include "phasecorrelation.h"
 using namespace std;
 
 template <typename TRegistration>
@@ -71,6 +72,7 @@ CompositeTransformType::Pointer translation(
                                           MetricType::New();
     transRegistration->SetMetric(         transMetric       );
   }
+  setMetricSampling( transRegistration.GetPointer(), params );
 
   TTransformType::Pointer   movingInitTx  = TTransformType::New();
 
@@ -124,7 +126,7 @@ CompositeTransformType::Pointer translation(
   } catch( itk::ExceptionObject & err ){
     cout << "ExceptionObject caught !" << endl;
     cout << err << endl;
-    exit(1);
+    throw;
   }
 
   compositeTransform->AddTransform(
@@ -141,3 +143,49 @@ CompositeTransformType::Pointer translation(
   return compositeTransform;
 
 }
+
+// Initial translation by phase correlation, one FFT pass instead of an
+// iterative registration, returned in the same form as translation()
+CompositeTransformType::Pointer phaseTranslation(
+                                ImageType* const fixed,
+                                ImageType* const moving,
+                                reg_params params ){
+
+  ImageType::SizeType size = fixed->GetLargestPossibleRegion().GetSize();
+  double shift[2];
+  double peak = phaseCorrelation( fixed->GetBufferPointer(),
+                                  moving->GetBufferPointer(),
+                                  size[0], size[1], shift,
+                                  params.phase_window );
+
+  TTransformType::Pointer   movingInitTx  = TTransformType::New();
+  TParametersType initialParameters( movingInitTx->GetNumberOfParameters() );
+
+  initialParameters[0] = shift[0]*fixed->GetSpacing()[0];
+  initialParameters[1] = shift[1]*fixed->GetSpacing()[1];
+
+  movingInitTx->SetParameters( initialParameters );
+
+  CompositeTransformType::Pointer  compositeTransform  =
+                                          CompositeTransformType::New();
+  compositeTransform->AddTransform( movingInitTx );
+
+  cout << "Phase correlation translation: " << initialParameters
+       << ", peak " << peak << endl;
+
+  return compositeTransform;
+}
+
+// Initial translation of rigid, similarity, affine and bspline registration.
+// translation = 1 uses phase correlation, 2 the iterative registration
+CompositeTransformType::Pointer initialTranslation(
+                                ImageType* const fixed,
+                                ImageType* const moving,
+                                reg_params params ){
+
+  if ( params.translation == 2 ||
+       fixed->GetLargestPossibleRegion().GetSize() != moving->GetLargestPossibleRegion().GetSize() ){
+    return translation( fixed, moving, params );
+  }
+  return phaseTranslation( fixed, moving, params );
+}
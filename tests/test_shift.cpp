@@ -0,0 +1,111 @@
+//==========================================================================
+// Copyright 2016 Stig Viste, Norwegian University of Science and Technology
+// Distributed under the MIT License.
+// (See accompanying file LICENSE or copy at
+// http://opensource.org/licenses/MIT
+// =========================================================================
+
+// Registers a band shifted far beyond the capture range of the optimizers
+// with the rigid, similarity and affine methods and phase correlation as
+// the initial translation. The resampled band must land on the fixed band,
+// so the shift has to be part of the transform that is resampled with.
+
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include "hyperspec.h"
+#include "registration.h"
+using namespace std;
+
+static const unsigned SIZE   = 160;
+static const double   SHIFTX = 23.4;
+static const double   SHIFTY = -17.0;
+// Pixels left out at every side, where the shifted band has no data
+static const unsigned BORDER = 30;
+
+// A few gaussian blobs, none symmetric with another, seen shifted by (dx, dy)
+static ImageType::Pointer blobs( double dx,
+                                 double dy ){
+  const double blob[4][3] = {
+    { 60.0,  70.0, 6.0 },
+    { 95.0,  62.0, 4.0 },
+    { 80.0, 100.0, 8.0 },
+    { 105.0, 95.0, 3.0 },
+  };
+
+  ImageType::IndexType start;
+  start.Fill( 0 );
+  ImageType::SizeType size;
+  size.Fill( SIZE );
+  ImageType::RegionType region;
+  region.SetSize( size );
+  region.SetIndex( start );
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  float *pixel = image->GetBufferPointer();
+  for ( unsigned y = 0; y < SIZE; y++ ){
+    for ( unsigned x = 0; x < SIZE; x++ ){
+      double value = 0.0;
+      for ( int b = 0; b < 4; b++ ){
+        double rx = x - dx - blob[b][0];
+        double ry = y - dy - blob[b][1];
+        value += 100.0*exp( -( rx*rx + ry*ry )/( 2.0*blob[b][2]*blob[b][2] ) );
+      }
+      pixel[y*SIZE + x] = value;
+    }
+  }
+  return image;
+}
+
+// Root mean square of a - b inside the border
+static double interiorRms( ImageType* const a,
+                           ImageType* const b ){
+  const float *pa = a->GetBufferPointer();
+  const float *pb = b->GetBufferPointer();
+  double sum = 0.0;
+  size_t count = 0;
+  for ( unsigned y = BORDER; y < SIZE - BORDER; y++ ){
+    for ( unsigned x = BORDER; x < SIZE - BORDER; x++ ){
+      double d = pa[y*SIZE + x] - pb[y*SIZE + x];
+      sum += d*d;
+      count++;
+    }
+  }
+  return sqrt( sum/count );
+}
+
+int main(){
+  ImageType::Pointer fixed = blobs( 0.0, 0.0 );
+  ImageType::Pointer moving = blobs( SHIFTX, SHIFTY );
+  double before = interiorRms( fixed, moving );
+
+  int failed = 0;
+  for ( int regmethod = 1; regmethod <= 3; regmethod++ ){
+    map<string, string> overrides;
+    overrides["regmethod"]   = to_string( regmethod );
+    overrides["translation"] = "1";
+    overrides["median"]      = "0";
+    overrides["gradient"]    = "0";
+    overrides["diff_conf"]   = "0";
+    overrides["output"]      = "0";
+    reg_params params;
+    if ( params_read( &params, "/nonexistent/params.conf", overrides ) != CONF_NO_ERR ){
+      printf( "regmethod %d: could not set parameters\n", regmethod );
+      return 1;
+    }
+
+    ImageType::Pointer output;
+    ImageType::Pointer outdiff;
+    registerBand( fixed, fixed, moving, moving, params, output, outdiff );
+
+    double after = interiorRms( fixed, output );
+    bool pass = after < 0.1*before;
+    printf( "regmethod %d: rms %g before, %g after, %s\n",
+            regmethod, before, after, pass ? "ok" : "FAILED" );
+    failed += !pass;
+  }
+  return failed;
+}